@@ -0,0 +1,72 @@
+#include <iostream>
+#include <string>
+
+#include "CountSketchTuner.h"
+#include "cxxopts.hpp"
+
+int main(int argc, char* argv[]) {
+    double eps;                   // Target error relative to the l2 norm
+    double delta;                 // Target failure probability
+    bool allow_float;             // Whether float counters may be chosen
+    size_t updates;               // Updates timed per cache level
+    std::string output_filename;  // Where to persist the chosen configuration
+
+    // clang-format off
+    cxxopts::Options options(
+        argv[0],
+        "Calibrates CountSketch update costs on this machine and picks the width,\n"
+        "depth and counter type that minimize update time for a target error.");
+    // clang-format on
+
+    try {
+        // clang-format off
+        options.add_options()
+            ("e,eps", "Target error relative to the l2 norm, in (0, 1)",
+            cxxopts::value<double>(eps)->default_value("0.1"))
+            ("d,delta", "Target failure probability, in (0, 1)",
+            cxxopts::value<double>(delta)->default_value("0.01"))
+            ("f,float", "Allow float counters (default: false)",
+            cxxopts::value<bool>(allow_float)->default_value("false"))
+            ("u,updates", "Updates timed per cache level (default: 262144)",
+            cxxopts::value<size_t>(updates)->default_value("262144"))
+            ("o,output", "Output filename to save the configuration",
+            cxxopts::value<std::string>(output_filename))
+            ("h,help","Print usage information");
+        // clang-format on
+
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            return 0;
+        }
+        if (!result.count("output")) {
+            throw cxxopts::exceptions::exception("Error: Missing required argument: --output (-o)");
+        }
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << "Error parsing options: " << e.what() << std::endl;
+        std::cerr << "Use --help for usage information." << std::endl;
+        return 1;
+    }
+
+    try {
+        CountSketchTuner tuner = CountSketchTuner::calibrated(updates);
+        const auto& caches = tuner.get_caches();
+        const auto& costs = tuner.get_double_costs();
+        std::cout << "Caches (bytes): L1 " << caches.l1 << ", L2 " << caches.l2 << ", L3 "
+                  << caches.l3 << std::endl;
+        std::cout << "Row update (ns): L1 " << costs.l1 << ", L2 " << costs.l2 << ", L3 "
+                  << costs.l3 << ", memory " << costs.mem << std::endl;
+
+        CountSketchConfig config = tuner.tune(eps, delta, allow_float);
+        std::cout << "Chosen: " << config << std::endl;
+
+        config.save(output_filename);
+        std::cout << "Output saved to '" << output_filename << "'." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
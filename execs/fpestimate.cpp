@@ -3,6 +3,23 @@
 
 #include "FpEstimator.h"
 
+// Whether two estimators built with consecutive seeds give different estimates of the
+// same stream. Estimators that share rows would give the same one, and a bank of them
+// built with seed + s, as in lpsampler.cpp, would fail together.
+template <typename Estimator>
+bool independent_seeds(uint64_t seed) {
+    Estimator a(0.2, 0.05, seed);
+    Estimator b(0.2, 0.05, seed + 1);
+    std::mt19937_64 rng(seed);
+    for (size_t t = 0; t < 5000; ++t) {
+        uint64_t key = rng() % 3000;
+        double delta = static_cast<double>(rng() % 20);
+        a.update(key, delta);
+        b.update(key, delta);
+    }
+    return a.estimate_norm() != b.estimate_norm();
+}
+
 int main() {
     std::random_device rd;
     uint64_t seed = rd();
@@ -43,5 +60,15 @@ int main() {
     std::cout << "Estimate for l1 norm: " << sketch_f1.estimate_norm() << std::endl;
     std::cout << "Actual l1 norm: " << l1_norm << std::endl;
 
+    if (!independent_seeds<F1Estimator>(seed)) {
+        std::cerr << "F1Estimators with consecutive seeds share rows" << std::endl;
+        return 1;
+    }
+    if (!independent_seeds<KnwF1Estimator>(seed)) {
+        std::cerr << "KnwF1Estimators with consecutive seeds share rows" << std::endl;
+        return 1;
+    }
+    std::cout << "Consecutive seeds give independent estimators" << std::endl;
+
     return 0;
 }
@@ -40,11 +40,22 @@ int main() {
     auto sampler_task = [&](std::stop_token stoken, size_t thread_idx) {
         size_t start = thread_idx * samplers_per_thread;
         size_t end = std::min(start + samplers_per_thread, num_samplers);
+        // Each thread feeds the stream to its samplers side by side, kept contiguous in
+        // one vector.
+        std::vector<LpSampler<1>> samplers;
+        samplers.reserve(end - start);
         for (size_t s = start; s < end && !stoken.stop_requested(); ++s) {
-            LpSampler sampler(1, eps, delta, n, seed + s);
-            for (size_t i = 0; i < n; ++i) {
+            samplers.emplace_back(eps, delta, n, seed + s);
+        }
+        // Another thread may find a sample while this one is still ingesting, so the
+        // stream is abandoned as soon as a stop is requested.
+        for (size_t i = 0; i < n && !stoken.stop_requested(); ++i) {
+            for (auto& sampler : samplers) {
                 sampler.update(i, freqs[i]);
             }
+        }
+        for (auto& sampler : samplers) {
+            if (stoken.stop_requested()) break;
             auto sample = sampler.sample();
             if (sample && !found_sample.exchange(true)) {
                 sampled_index = *sample;
@@ -0,0 +1,92 @@
+#ifndef COUNT_MIN_SKETCH_H_
+#define COUNT_MIN_SKETCH_H_
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "Serialization.h"
+#include "SketchTable.h"
+
+// A Count-Min sketch for insert-only (or strict turnstile) streams. Shares the bucket
+// hashing and counter layer with CountSketch, but has no sign hash and estimates with
+// the minimum over rows, which never underestimates a non-negative frequency.
+class CountMinSketch {
+  public:
+    /**
+     * Constructs a Count-Min sketch with width w and depth d. Throws
+     * std::invalid_argument if w or d is 0.
+     *
+     * \param w The size of each row in the sketch. Assumes w < 2^61 -1.
+     * \param d The number of hash rows in the sketch. Defaults to 5.
+     * \param seed The seed for the random number generator. Defaults to 42.
+     * \param murmur Whether to use MurmurHash3 for hashing. Defaults to false.
+     * \param conservative Whether to use conservative update, which only raises the
+     * counters that are below the new estimate. Requires non-negative deltas. Defaults to
+     * false.
+     * \param sparse Whether to start with a sparse map of touched counters, converted
+     * to the dense table once enough counters are non-zero. Defaults to false.
+     * \param counter The storage type of the dense counters. Defaults to double.
+     */
+    CountMinSketch(size_t w,
+                   size_t d = 5,
+                   uint64_t seed = 42,
+                   bool murmur = false,
+                   bool conservative = false,
+                   bool sparse = false,
+                   CounterType counter = CounterType::kDouble);
+    ~CountMinSketch() = default;
+    CountMinSketch(const CountMinSketch& other) = default;
+    CountMinSketch& operator=(const CountMinSketch& other) = default;
+    CountMinSketch(CountMinSketch&& other) = default;
+    CountMinSketch& operator=(CountMinSketch&& other) = default;
+
+    // Modifies the sketch to handle stream updates of the form (key, delta).
+    void update(const uint64_t key, const double delta);
+    // Computes an estimate of the frequency of a given key.
+    int64_t estimate(const uint64_t key) const;
+
+    // Applies the updates (keys[j], deltas[j]) in order.
+    void update_batch(const std::vector<uint64_t>& keys,
+                      const std::vector<double>& deltas);
+    // Computes the estimate of each key in keys.
+    std::vector<int64_t> estimate_batch(const std::vector<uint64_t>& keys) const;
+
+    // Adds or subtracts the counters of another CountMinSketch built with the same
+    // parameters, or multiplies every counter by a. Conservative update is not linear,
+    // so conservative sketches can only be merged and scaled by a >= 0.
+    void merge(const CountMinSketch& other);
+    void subtract(const CountMinSketch& other);
+    void scale(double a);
+    CountMinSketch& operator+=(const CountMinSketch& other) {
+        merge(other);
+        return *this;
+    }
+    CountMinSketch& operator-=(const CountMinSketch& other) {
+        subtract(other);
+        return *this;
+    }
+
+    size_t get_w() const { return table_.get_w(); }
+    size_t get_d() const { return table_.get_d(); }
+    bool is_conservative() const { return conservative_; }
+    // Whether the counters are still held in the sparse map.
+    bool is_sparse() const { return table_.is_sparse(); }
+
+    // Saves the sketch in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static CountMinSketch load(std::istream& is);
+    // Writes and reads the sketch without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static CountMinSketch read(serialization::BinaryReader& in);
+
+    friend std::ostream& operator<<(std::ostream& os, const CountMinSketch& cms);
+
+  private:
+    CountMinSketch(SketchTable table, bool conservative);
+
+    SketchTable table_;  // Counters and bucket hashes, d x w
+    bool conservative_;
+};
+
+#endif  // COUNT_MIN_SKETCH_H_
@@ -3,9 +3,14 @@
 
 #include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "KWiseHash.h"
+#include "Serialization.h"
+#include "SketchTable.h"
 
 class CountSketch {
   public:
@@ -16,32 +21,133 @@ class CountSketch {
      * \param d The number of hash/sign rows in the sketch. Defaults to 5.
      * \param seed The seed for the random number generator. Defaults to 42.
      * \param murmur Whether to use MurmurHash3 for hashing. Defaults to false.
+     * \param sparse Whether to start with a sparse map of touched counters, converted
+     * to the dense table once enough counters are non-zero. Defaults to false.
+     * \param counter The storage type of the dense counters. Defaults to double.
      */
-    CountSketch(size_t w, size_t d = 5, uint64_t seed = 42, bool murmur = false);
+    CountSketch(size_t w,
+                size_t d = 5,
+                uint64_t seed = 42,
+                bool murmur = false,
+                bool sparse = false,
+                CounterType counter = CounterType::kDouble);
     ~CountSketch() = default;
     CountSketch(const CountSketch& other) = default;
     CountSketch& operator=(const CountSketch& other) = default;
+    CountSketch(CountSketch&& other) = default;
+    CountSketch& operator=(CountSketch&& other) = default;
 
     // Modifies the CountSketch to handle stream updates of the form (key, delta).
     void update(const uint64_t key, const double delta);
+    // As update(), for a key below 2^61 whose first kHashPowers powers were written by
+    // KWiseHash::powers(), so that the sketch hashes it from them. A caller updating
+    // several sketches computes the powers of the key once for all of them.
+    void update(const uint64_t key, const uint64_t* powers, const double delta);
+    // Number of powers of a key that the hashes of a CountSketch evaluate.
+    static constexpr uint64_t kHashPowers = 4;
     // Computes an estimate of the frequency of a given key.
     int64_t estimate(const uint64_t key) const;
+    // As estimate(), hashing a key below 2^61 from its powers as in update() unless
+    // powers is null, and with scratch as room for the d row estimates, so that a scan
+    // over many keys allocates nothing.
+    int64_t estimate(const uint64_t key, const uint64_t* powers, double* scratch) const;
+
+    // Applies the updates (keys[j], deltas[j]) one row at a time.
+    void update_batch(const std::vector<uint64_t>& keys,
+                      const std::vector<double>& deltas);
+    // Computes the estimate of each key in keys.
+    std::vector<int64_t> estimate_batch(const std::vector<uint64_t>& keys) const;
+
+    // Adds or subtracts the counters of another CountSketch built with the same
+    // parameters, or multiplies every counter by a. The sketch is linear in the stream,
+    // so the result summarizes the sum, difference or scaled stream.
+    void merge(const CountSketch& other);
+    void subtract(const CountSketch& other);
+    void scale(double a);
+    CountSketch& operator+=(const CountSketch& other) {
+        merge(other);
+        return *this;
+    }
+    CountSketch& operator-=(const CountSketch& other) {
+        subtract(other);
+        return *this;
+    }
+
+    // Materializes the bucket and sign of every key in [0, n) in each row, so that
+    // updates and estimates of these keys look them up instead of hashing. Takes 4 n d
+    // bytes, filled by num_threads threads, or one per hardware thread if num_threads
+    // is 0. Copies of the sketch share the arrays, which are not saved.
+    void precompute(uint64_t n, size_t num_threads = 0);
+    // Number of keys whose buckets and signs are materialized.
+    uint64_t precomputed() const { return precomputed_; }
+
+    size_t get_w() const { return table_.get_w(); }
+    size_t get_d() const { return table_.get_d(); }
+    // Whether the counters are still held in the sparse map.
+    bool is_sparse() const { return table_.is_sparse(); }
+
+    /**
+     * Creates a CountSketch whose counters live in a new memory-mapped file at path,
+     * so that it can be reopened with open_mapped() without reading the table.
+     * Parameters are as for the constructor. The file layout is described in
+     * MappedFile.h and SketchTable::create_mapped().
+     */
+    static CountSketch create_mapped(const std::string& path,
+                                     size_t w,
+                                     size_t d = 5,
+                                     uint64_t seed = 42,
+                                     bool murmur = false,
+                                     CounterType counter = CounterType::kDouble);
+    // Maps a file written by create_mapped(). Pages are read lazily on first access.
+    static CountSketch open_mapped(const std::string& path);
+    // Flushes the counters of a mapped sketch to its file. Does nothing otherwise.
+    void sync() const { table_.sync(); }
+    bool is_mapped() const { return table_.is_mapped(); }
+
+    // Saves the sketch in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static CountSketch load(std::istream& is);
+    // Writes and reads the sketch without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static CountSketch read(serialization::BinaryReader& in);
 
     friend std::ostream& operator<<(std::ostream& os, const CountSketch& cs);
+    friend double inner_product(const CountSketch& a, const CountSketch& b);
 
   private:
-    const uint64_t seed_;
-    const size_t w_;  // size of row
-    const size_t d_;  // number of hash/sign rows
-    const bool use_murmur_;
-
-    std::vector<std::vector<double>> table_;  // Sketch matrix of size d_ x w_
+    explicit CountSketch(SketchTable table);
 
-    std::vector<KWiseHash> index_hashes;
+    SketchTable table_;  // Counters and bucket hashes, d x w
     std::vector<KWiseHash> sign_hashes;
 
-    size_t idx_hash(const size_t i, const uint64_t key) const;
-    int sign_hash(const size_t i, const uint64_t key) const;
+    // With precompute(), entry key * d + i is the bucket of key in row i, with the top
+    // bit set if its sign is negative.
+    std::shared_ptr<const std::vector<uint32_t>> slots_;
+    uint64_t precomputed_ = 0;
+    static constexpr uint32_t kNegative = 1u << 31;
+
+    int sign_hash(const size_t i,
+                  const uint64_t key,
+                  const uint64_t* powers = nullptr) const;
+    // The bucket of key in row i, and its sign applied to val. The hashes are evaluated
+    // from the powers of the key if they are given.
+    size_t slot(const size_t i,
+                const uint64_t key,
+                double& val,
+                const uint64_t* powers = nullptr) const;
 };
 
+// Estimates <x, y> for the streams x and y summarized by two CountSketches built with
+// the same parameters, as the median over rows of the row dot products.
+double inner_product(const CountSketch& a, const CountSketch& b);
+
+// Finds the k keys in [0, n) whose estimated frequency changed the most from before to
+// after, as (key, change) pairs sorted by decreasing |change|. The key domain is
+// scanned by num_threads threads, or one per hardware thread if num_threads is 0.
+std::vector<std::pair<uint64_t, int64_t>> heavy_changes(const CountSketch& before,
+                                                        const CountSketch& after,
+                                                        size_t k,
+                                                        uint64_t n,
+                                                        size_t num_threads = 0);
+
 #endif  // COUNT_SKETCH_H_
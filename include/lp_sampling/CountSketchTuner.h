@@ -0,0 +1,86 @@
+#ifndef COUNT_SKETCH_TUNER_H_
+#define COUNT_SKETCH_TUNER_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "SketchTable.h"
+
+// Shape of a CountSketch chosen by CountSketchTuner. A zero width or depth means the
+// caller's default.
+struct CountSketchConfig {
+    size_t w = 0;
+    size_t d = 0;
+    CounterType counter = CounterType::kDouble;
+    double ns_per_update = 0;  // predicted cost of one update
+
+    // Persists the configuration as a small text file of "key value" lines.
+    void save(const std::string& path) const;
+    // Reads a configuration written by save().
+    static CountSketchConfig load(const std::string& path);
+};
+
+std::ostream& operator<<(std::ostream& os, const CountSketchConfig& config);
+
+// Picks the CountSketch width, depth and counter type that minimize update time for a
+// target error and failure probability on this machine.
+//
+// A row of width w fails to estimate a key within eps * ||x||_2 with probability at
+// most q = 1 / (w * eps^2), and the median of d rows fails with probability at most
+// (4q(1 - q))^{d/2}. Wider rows therefore need fewer of them, and the tuner trades the
+// two off against the measured cost of a row update at each level of the cache
+// hierarchy the d x w table would occupy.
+class CountSketchTuner {
+  public:
+    struct CacheSizes {
+        size_t l1;  // bytes
+        size_t l2;
+        size_t l3;
+    };
+
+    // Nanoseconds per row update when the table fits in each level of the hierarchy.
+    struct UpdateCosts {
+        double l1;
+        double l2;
+        double l3;
+        double mem;
+    };
+
+    CountSketchTuner(const CacheSizes& caches, const UpdateCosts& double_costs);
+    CountSketchTuner(const CacheSizes& caches,
+                     const UpdateCosts& double_costs,
+                     const UpdateCosts& float_costs);
+
+    // Reads the data cache sizes of this machine, falling back to common values.
+    static CacheSizes detect_caches();
+    // Times CountSketch updates against tables sized for each cache level.
+    static UpdateCosts calibrate(const CacheSizes& caches,
+                                 CounterType counter,
+                                 size_t updates = 1 << 18);
+    // Detects the caches and calibrates both counter types.
+    static CountSketchTuner calibrated(size_t updates = 1 << 18);
+
+    /**
+     * Picks the configuration with the lowest predicted update time.
+     *
+     * \param eps The desired additive error, relative to the l2 norm of the stream.
+     * \param delta The desired failure probability per estimate.
+     * \param allow_float Whether float counters may be chosen.
+     * \return The chosen width, depth and counter type.
+     */
+    CountSketchConfig tune(double eps, double delta, bool allow_float = false) const;
+
+    const CacheSizes& get_caches() const { return caches_; }
+    const UpdateCosts& get_double_costs() const { return double_costs_; }
+    const UpdateCosts& get_float_costs() const { return float_costs_; }
+
+  private:
+    CacheSizes caches_;
+    UpdateCosts double_costs_;
+    UpdateCosts float_costs_;
+
+    double row_cost(size_t bytes, const UpdateCosts& costs) const;
+};
+
+#endif  // COUNT_SKETCH_TUNER_H_
@@ -0,0 +1,89 @@
+#ifndef DYADIC_COUNT_SKETCH_H_
+#define DYADIC_COUNT_SKETCH_H_
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "CountSketch.h"
+#include "Serialization.h"
+#include "SketchTable.h"
+
+// Range sums over the key domain [0, n). Level l summarizes the stream with every key
+// replaced by key >> l, so a range [lo, hi) is the sum of at most 2 log n dyadic
+// intervals, each a single point estimate at some level. Levels whose domain fits in w
+// counters are kept exactly instead of in a CountSketch.
+class DyadicCountSketch {
+  public:
+    /**
+     * Constructs a dyadic CountSketch over the keys [0, n).
+     *
+     * \param n The size of the key domain. Keys must be smaller than n.
+     * \param w The width of the CountSketch at each level.
+     * \param d The depth of the CountSketch at each level. Defaults to 5.
+     * \param seed The seed for the random number generator. Defaults to 42.
+     * \param murmur Whether to use MurmurHash3 for hashing. Defaults to false.
+     * \param sparse Whether the CountSketches start with a sparse map of touched
+     * counters. Defaults to false.
+     * \param counter The storage type of the dense counters. Defaults to double.
+     */
+    DyadicCountSketch(uint64_t n,
+                      size_t w,
+                      size_t d = 5,
+                      uint64_t seed = 42,
+                      bool murmur = false,
+                      bool sparse = false,
+                      CounterType counter = CounterType::kDouble);
+
+    // Modifies every level to handle stream updates of the form (key, delta).
+    void update(const uint64_t key, const double delta);
+    // Applies the updates (keys[j], deltas[j]) one level at a time.
+    void update_batch(const std::vector<uint64_t>& keys,
+                      const std::vector<double>& deltas);
+
+    // Computes an estimate of the frequency of a given key.
+    int64_t estimate(const uint64_t key) const;
+    // Computes an estimate of the total frequency of the keys in [lo, hi).
+    int64_t range_sum(uint64_t lo, uint64_t hi) const;
+
+    // Adds or subtracts the counters of another DyadicCountSketch built with the same
+    // parameters, or multiplies every counter by a.
+    void merge(const DyadicCountSketch& other);
+    void subtract(const DyadicCountSketch& other);
+    void scale(double a);
+    DyadicCountSketch& operator+=(const DyadicCountSketch& other) {
+        merge(other);
+        return *this;
+    }
+    DyadicCountSketch& operator-=(const DyadicCountSketch& other) {
+        subtract(other);
+        return *this;
+    }
+
+    uint64_t get_n() const { return n_; }
+    // Number of levels, including the exact ones.
+    size_t get_levels() const { return sketches_.size() + exact_.size(); }
+
+    // Saves the sketch in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static DyadicCountSketch load(std::istream& is);
+    // Writes and reads the sketch without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static DyadicCountSketch read(serialization::BinaryReader& in);
+
+  private:
+    DyadicCountSketch(uint64_t n,
+                      std::vector<CountSketch> sketches,
+                      std::vector<std::vector<double>> exact);
+
+    uint64_t n_;                              // size of the key domain
+    std::vector<CountSketch> sketches_;       // levels 0 .. sketches_.size() - 1
+    std::vector<std::vector<double>> exact_;  // the remaining levels, counted exactly
+
+    // Estimate of the frequency of node idx at the given level.
+    double node(const size_t level, const uint64_t idx) const;
+    // Throws unless other has the same domain and number of CountSketch levels.
+    void check_compatible(const DyadicCountSketch& other) const;
+};
+
+#endif  // DYADIC_COUNT_SKETCH_H_
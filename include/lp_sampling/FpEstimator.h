@@ -3,9 +3,15 @@
 
 #include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "KWiseHash.h"
+#include "MappedFile.h"
+#include "Serialization.h"
+#include "SketchTable.h"
 
 class FpEstimator {
   public:
@@ -14,47 +20,154 @@ class FpEstimator {
     virtual double estimate_norm() const = 0;
 };
 
-class F2Estimator : public FpEstimator {
+class F2Estimator final : public FpEstimator {
   public:
     /**
-     * Constructs a CountSketch data structure with a single row of width 6 * (eps^2 *
-     * delta)^{-1}.
+     * Constructs a CountSketch data structure with O(log(1/delta)) rows of width
+     * O(1/eps^2), whose row estimates are combined by their median.
      *
      * \param eps The desired error rate. Defaults to 0.1.
      * \param delta The desired failure probability. Defaults to 0.01.
      * \param seed The seed for the random number generator. Defaults to 42.
      * \param murmur Whether to use MurmurHash3 for hashing. Defaults to false.
+     * \param track_norm Whether to maintain the sum of squares of each row during
+     * updates, so that estimate_norm() takes O(d) rather than O(d w) time. Defaults to
+     * false.
+     * \param counter The storage type of the counters. Norms are always accumulated in
+     * double precision. Defaults to double.
      */
     F2Estimator(double eps = 0.1,
                 double delta = 0.01,
                 uint64_t seed = 42,
-                bool murmur = false);
+                bool murmur = false,
+                bool track_norm = false,
+                CounterType counter = CounterType::kDouble);
 
     // Modifies the CountSketch to handle stream updates of the form (key, delta).
     void update(const uint64_t key, const double delta) override;
-    // Computes an estimate of the frequency of a given key.
+    // As update(), for a key below 2^61 whose first kHashPowers powers were written by
+    // KWiseHash::powers(), so that the sketch hashes it from them.
+    void update(const uint64_t key, const uint64_t* powers, const double delta);
+    // Computes an estimate of the l2 norm of the stream.
     double estimate_norm() const override;
+    // Estimates the l2 norm of the stream minus the vector that is value at key for each
+    // (key, value) in entries, without modifying the counters. buckets is room for the
+    // buckets of the entries, which a caller that keeps it allocates only once.
+    double estimate_residual_norm(const std::vector<std::pair<uint64_t, double>>& entries,
+                                  std::vector<std::pair<size_t, double>>& buckets) const;
 
+    // Number of powers of a key that the hashes of an F2Estimator evaluate.
+    static constexpr uint64_t kHashPowers = 4;
+
+    // Adds or subtracts the counters of another F2Estimator built with the same
+    // parameters, or multiplies every counter by a.
+    void merge(const F2Estimator& other);
     void subtract(const F2Estimator& other);
+    void scale(double a);
+    F2Estimator& operator+=(const F2Estimator& other) {
+        merge(other);
+        return *this;
+    }
+    F2Estimator& operator-=(const F2Estimator& other) {
+        subtract(other);
+        return *this;
+    }
+
+    // Whether other has the same parameters, and so hashes every key the same way.
+    bool compatible(const F2Estimator& other) const;
+
+    size_t get_w() const { return w_; }
+    size_t get_d() const { return d_; }
+    bool tracks_norm() const { return track_norm_; }
+    CounterType get_counter() const { return counter_; }
+
+    /**
+     * Creates an F2Estimator whose counters live in a new memory-mapped file at path,
+     * so that it can be reopened with open_mapped() without reading the table.
+     * Parameters are as for the constructor. Besides the header of MappedFile.h, the
+     * file records eps f64 at byte 8, delta f64 at byte 16, seed u64 at byte 24, w u64
+     * at byte 32, d u64 at byte 40, murmur u8 at byte 48, track_norm u8 at byte 49 and
+     * counter u8 at byte 50.
+     */
+    static F2Estimator create_mapped(const std::string& path,
+                                     double eps = 0.1,
+                                     double delta = 0.01,
+                                     uint64_t seed = 42,
+                                     bool murmur = false,
+                                     bool track_norm = false,
+                                     CounterType counter = CounterType::kDouble);
+    // Maps a file written by create_mapped(). Pages are read lazily on first access.
+    static F2Estimator open_mapped(const std::string& path);
+    // Flushes the counters of a mapped estimator to its file. Does nothing otherwise.
+    void sync() const;
+    bool is_mapped() const { return table_.file() || table32_.file(); }
+
+    // Saves the estimator in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static F2Estimator load(std::istream& is);
+    // Writes and reads the estimator without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static F2Estimator read(serialization::BinaryReader& in);
 
     friend std::ostream& operator<<(std::ostream& os, const F2Estimator& sketch);
+    friend double inner_product(const F2Estimator& a, const F2Estimator& b);
 
   private:
     const size_t w_;  // size of row
+    const size_t d_;  // number of rows
     const double eps_;
     const double delta_;
     const uint64_t seed_;
     const bool use_murmur_;
+    const bool track_norm_;
+    const CounterType counter_;
+
+    CounterBuffer<double> table_;   // Matrix of size d_ x w_, row-major, for kDouble
+    CounterBuffer<float> table32_;  // Matrix of size d_ x w_, row-major, for kFloat
 
-    std::vector<double> table_;  // Sketch vector of size w_
+    // With track_norm_, the sum of squares of each row, updated by (2c + v) v whenever
+    // v is added to a counter c. Rounding errors accumulate in these sums, so they are
+    // recomputed from the table after every kRecomputeFactor * w_ updates.
+    std::vector<double> row_sq_;
+    size_t pending_updates_ = 0;
+    static constexpr size_t kRecomputeFactor = 16;
 
-    KWiseHash index_hash_;
-    KWiseHash sign_hash_;
+    std::vector<KWiseHash> index_hashes_;
+    std::vector<KWiseHash> sign_hashes_;
 
-    size_t idx_hash(const uint64_t key) const;
-    int sign_hash(const uint64_t key) const;
+    // Builds an estimator whose counters are the table of file after its header, which
+    // must hold d x w of them, or owned ones if file is null.
+    F2Estimator(double eps,
+                double delta,
+                uint64_t seed,
+                bool murmur,
+                bool track_norm,
+                CounterType counter,
+                std::shared_ptr<MappedFile> file);
+
+    static size_t width(double eps);
+    static size_t depth(double delta);
+
+    // The bucket and sign of key in row i, evaluated from its powers if they are given.
+    size_t idx_hash(const size_t i,
+                    const uint64_t key,
+                    const uint64_t* powers = nullptr) const;
+    int sign_hash(const size_t i,
+                  const uint64_t key,
+                  const uint64_t* powers = nullptr) const;
+
+    // Dot product of the i-th row with the i-th row of a compatible estimator.
+    double row_dot(const F2Estimator& other, const size_t i) const;
+    // Adds a * other to the counters.
+    void add_scaled(const F2Estimator& other, double a);
+    // Recomputes row_sq_ from the table if track_norm_ is set.
+    void recompute_norms();
 };
 
+// Estimates <x, y> for the streams x and y summarized by two F2Estimators built with the
+// same parameters.
+double inner_product(const F2Estimator& a, const F2Estimator& b);
+
 class cauchy_distribution {
   public:
     cauchy_distribution(uint64_t k, uint64_t seed);
@@ -63,38 +176,292 @@ class cauchy_distribution {
     cauchy_distribution(const cauchy_distribution& other) = default;
     cauchy_distribution& operator=(const cauchy_distribution& other);
 
+    // The Cauchy variable of key i, equal to at(mix(i)).
     double operator()(size_t i) const;
+    // The Cauchy variable of a key mixed by mix(). The mixed key does not depend on the
+    // row, so an update of many rows computes it once.
+    double at(uint64_t mixed) const;
+    // The uniform variable in [0, 1) of a mixed key, whose image under simd::cauchy()
+    // is at(mixed). Lets updates of many rows transform all uniforms in one pass. The
+    // hash is reduced modulo 2^61 - 1 only for inputs below 2^61, so it is given the top
+    // 61 bits of the mixed key.
+    double uniform(uint64_t mixed) const {
+        return uniform(hash_.coefficients(), k_, mixed);
+    }
+    // The uniform variable of a mixed key from the powers of mixed >> 3 written by
+    // KWiseHash::powers(), equal to uniform(mixed). Distributions of the same
+    // independence can share the powers of a key.
+    double uniform_powers(const uint64_t* powers) const {
+        return uniform_powers(hash_.coefficients(), k_, powers);
+    }
+    // Writes uniform(mixed[j]) to out[j] for j < m, hashing several keys at once.
+    void uniforms(const uint64_t* mixed, double* out, size_t m) const {
+        uniforms(hash_.coefficients(), k_, mixed, out, m);
+    }
+    // As uniform(), uniform_powers() and uniforms(), for the distribution whose hash has
+    // the k coefficients a, e.g. a row of a matrix holding the coefficients of many.
+    static double uniform(const uint64_t* a, uint64_t k, uint64_t mixed) {
+        return KWiseHash::eval(a, k, mixed >> 3) / static_cast<double>(kMp);
+    }
+    static double uniform_powers(const uint64_t* a, uint64_t k, const uint64_t* powers) {
+        return KWiseHash::eval_powers(a, k, powers) / static_cast<double>(kMp);
+    }
+    static void uniforms(
+        const uint64_t* a, uint64_t k, const uint64_t* mixed, double* out, size_t m);
+    // Spreads the bits of a key with the SplitMix64 finalizer, a stateless bijection.
+    static uint64_t mix(uint64_t key) {
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+        return key ^ (key >> 31);
+    }
+
+    uint64_t get_k() const { return k_; }
+    uint64_t get_seed() const { return seed_; }
 
   private:
     uint64_t k_;      // k-wise indepedence parameter
+    uint64_t seed_;   // seed of the hash coefficients
     KWiseHash hash_;  // k-wise hash function for thetas
+
+    static constexpr uint64_t kMp = (1ULL << 61) - 1;  // modulus of the hash
+};
+
+// How F1Estimator combines its projections, each the l1 norm times a Cauchy variable,
+// into an estimate of the norm. The estimators of Li and Hastie for Cauchy projections.
+enum class F1Mode : uint8_t {
+    kMedian = 0,             // median of the |projections|
+    kGeometricMean = 1,      // bias-corrected geometric mean of the |projections|
+    kMaximumLikelihood = 2,  // bias-corrected maximum likelihood scale, 19% fewer rows
 };
 
-class F1Estimator : public FpEstimator {
+class F1Estimator final : public FpEstimator {
   public:
-    F1Estimator(double eps = 0.1, double delta = 0.01, uint64_t seed = 42);
+    /**
+     * Constructs a sketch of w = O(log(1/delta) / eps^2) Cauchy projections.
+     *
+     * \param eps The desired error rate. Defaults to 0.1.
+     * \param delta The desired failure probability. Defaults to 0.01.
+     * \param seed The seed for the random number generator. Defaults to 42.
+     * \param counter The storage type of the projections. The estimate is always
+     * computed in double precision. Defaults to double.
+     * \param mode The estimator of the norm from the projections, which determines w
+     * through its variance. Defaults to the median.
+     */
+    F1Estimator(double eps = 0.1,
+                double delta = 0.01,
+                uint64_t seed = 42,
+                CounterType counter = CounterType::kDouble,
+                F1Mode mode = F1Mode::kMedian);
 
     ~F1Estimator() = default;
     F1Estimator(const F1Estimator& other) = default;
     F1Estimator& operator=(const F1Estimator& other) = default;
+    F1Estimator(F1Estimator&& other) = default;
 
     // Modifies the table to handle stream updates of the form (key, delta).
     void update(const uint64_t key, const double delta) override;
-    // Computes an estimate of the frequency of a given key.
+    // Applies the updates (keys[j], deltas[j]) one tile of rows at a time. The result
+    // equals that of update() up to the order of floating-point additions.
+    void update_batch(const std::vector<uint64_t>& keys,
+                      const std::vector<double>& deltas);
+    // Computes an estimate of the l1 norm of the stream.
     double estimate_norm() const override;
 
     size_t get_w() const { return w_; }
-    size_t get_eps() const { return eps_; }
-    size_t get_delta() const { return delta_; }
+    double get_eps() const { return eps_; }
+    double get_delta() const { return delta_; }
+    CounterType get_counter() const { return counter_; }
+    F1Mode get_mode() const { return mode_; }
+
+    // Materializes the Cauchy variables of every key in [0, n) in single precision, so
+    // that updates of these keys read them instead of hashing. Takes 4 n w bytes,
+    // filled by num_threads threads, or one per hardware thread if num_threads is 0.
+    // Copies of the estimator share the array, which is not saved. Rounding changes
+    // each variable by a relative 6e-8 against an update that hashes.
+    void precompute(uint64_t n, size_t num_threads = 0);
+    // Number of keys whose Cauchy variables are materialized.
+    uint64_t precomputed() const { return precomputed_; }
+
+    // Adds or subtracts the projections of another F1Estimator built with the same
+    // parameters, or multiplies every projection by a. The row seeds are derived from
+    // the seed, so estimators built separately, e.g. on shards of a stream, can be
+    // combined. Both must also have precomputed the same keys, since precomputed
+    // variables are rounded to single precision.
+    void merge(const F1Estimator& other);
+    void subtract(const F1Estimator& other);
+    void scale(double a);
+    F1Estimator& operator+=(const F1Estimator& other) {
+        merge(other);
+        return *this;
+    }
+    F1Estimator& operator-=(const F1Estimator& other) {
+        subtract(other);
+        return *this;
+    }
+
+    // Whether other has the same parameters and row seeds, and so projects every key
+    // the same way.
+    bool compatible(const F1Estimator& other) const;
+
+    // Independence of the Cauchy variables in each row for error rate eps.
+    static uint64_t independence(double eps);
+
+    // Saves the estimator in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static F1Estimator load(std::istream& is);
+    // Writes and reads the estimator without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static F1Estimator read(serialization::BinaryReader& in);
 
   private:
+    F1Estimator(double eps,
+                double delta,
+                uint64_t seed,
+                CounterType counter,
+                F1Mode mode,
+                const std::vector<uint64_t>& row_seeds);
+
+    static size_t width(double eps, double delta, F1Mode mode);
+    static std::vector<uint64_t> row_seeds(size_t w, uint64_t seed);
+
+    // Adds a * other to the projections.
+    void add_scaled(const F1Estimator& other, double a);
+
     const size_t w_;  // size of row
     const double eps_;
     const double delta_;
     const uint64_t seed_;
+    const CounterType counter_;
+    const F1Mode mode_;
+    const uint64_t k_;  // independence of the Cauchy variables
 
+    std::vector<uint64_t> row_seeds_;  // seed of the Cauchy hash of each row
+    // Coefficients of the Cauchy hashes, w_ x k_ row-major, so that row i evaluates the
+    // k_ contiguous coefficients from coeffs_[i * k_].
+    std::vector<uint64_t> coeffs_;
+    std::vector<double> table_;   // Sketch vector of size w_, for kDouble
+    std::vector<float> table32_;  // Sketch vector of size w_, for kFloat
+    std::vector<double> scratch_;   // room for the Cauchy variables of an update
+    std::vector<uint64_t> powers_;  // room for the powers of the mixed key of an update
+
+    // With precompute(), entry key * w_ + i is the Cauchy variable of key in row i.
+    std::shared_ptr<const std::vector<float>> cauchy_;
+    uint64_t precomputed_ = 0;
+
+    // Writes the Cauchy variable of key in each row to rvs, with powers as room for the
+    // k_ powers of its mixed key.
+    void variables(const uint64_t key, double* rvs, uint64_t* powers) const;
+
+    // Adds delta times the Cauchy variables of key to the projections.
+    void add_key(const uint64_t key, const double delta);
+
+    // The estimates of the norm from the w_ |projections| in abs.
+    double geometric_mean(const double* abs) const;
+    double maximum_likelihood(double* abs) const;
+    // Bound on the Newton steps of maximum_likelihood(), which takes about 5 from the
+    // median.
+    static constexpr int kMaxNewtonSteps = 50;
+
+    // update_batch() works on tiles of kRowTile rows and blocks of kKeyBlock keys, whose
+    // kRowTile x kKeyBlock Cauchy variables take 16 KiB. The hash coefficients of a
+    // tile stay in cache across the batch.
+    static constexpr size_t kRowTile = 128;
+    static constexpr size_t kKeyBlock = 16;
+    // Estimators with at least this many coefficients draw them on all hardware threads.
+    static constexpr size_t kParallelCoefficients = 1 << 16;
+};
+
+// An l1 estimator in the style of Kane, Nelson, Porat and Woodruff, whose updates touch
+// two counters in each of d rows instead of all w projections of F1Estimator. Each row
+// hashes the keys into w buckets, each holding a Cauchy projection and a sum of its keys
+// with random signs. Buckets whose signed sum stands out against the median projection
+// are dominated by a heavy key and counted by that sum. The mass of the other buckets is
+// estimated from the mean of cos(y / T) over their projections y, which is about
+// exp(-mass / T) per bucket.
+class KnwF1Estimator final : public FpEstimator {
+  public:
+    /**
+     * Constructs d = O(log(1/delta)) rows of w = O(1/eps^2) buckets.
+     *
+     * \param eps The desired error rate. Defaults to 0.1.
+     * \param delta The desired failure probability. Defaults to 0.01.
+     * \param seed The seed for the random number generator. Defaults to 42.
+     */
+    KnwF1Estimator(double eps = 0.1, double delta = 0.01, uint64_t seed = 42);
+
+    // Modifies one bucket per row to handle stream updates of the form (key, delta).
+    void update(const uint64_t key, const double delta) override;
+    // As update(), for a key below 2^61 whose first kHashPowers powers were written by
+    // KWiseHash::powers(), from which its buckets and signs are hashed.
+    void update(const uint64_t key, const uint64_t* powers, const double delta);
+    // Number of powers of a key that the bucket and sign hashes evaluate.
+    static constexpr uint64_t kHashPowers = 4;
+    // Computes an estimate of the l1 norm of the stream, as the median of the row
+    // estimates.
+    double estimate_norm() const override;
+
+    // Adds or subtracts the counters of another KnwF1Estimator built with the same
+    // parameters, or multiplies every counter by a.
+    void merge(const KnwF1Estimator& other);
+    void subtract(const KnwF1Estimator& other);
+    void scale(double a);
+    KnwF1Estimator& operator+=(const KnwF1Estimator& other) {
+        merge(other);
+        return *this;
+    }
+    KnwF1Estimator& operator-=(const KnwF1Estimator& other) {
+        subtract(other);
+        return *this;
+    }
+
+    // Whether other has the same parameters, and so hashes every key the same way.
+    bool compatible(const KnwF1Estimator& other) const;
+
+    size_t get_w() const { return w_; }
+    size_t get_d() const { return d_; }
+
+    // Saves the estimator in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static KnwF1Estimator load(std::istream& is);
+    // Writes and reads the estimator without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static KnwF1Estimator read(serialization::BinaryReader& in);
+
+  private:
+    const size_t w_;  // buckets per row
+    const size_t d_;  // number of rows
+    const double eps_;
+    const double delta_;
+    const uint64_t seed_;
+
+    std::vector<double> proj_;  // Cauchy projection of each bucket, d_ x w_ row-major
+    std::vector<double> sums_;  // Signed sum of each bucket, d_ x w_ row-major
+    // Room for the powers of the mixed key and the Cauchy variables of an update
+    std::vector<uint64_t> mixed_powers_;
+    std::vector<double> rvs_;
+
+    std::vector<KWiseHash> index_hashes_;
+    std::vector<KWiseHash> sign_hashes_;
     std::vector<cauchy_distribution> dists_;
-    std::vector<double> table_;  // Sketch vector of size
+
+    // A bucket is heavy if its signed sum exceeds kHeavyFactor times the median
+    // |projection| of its row.
+    static constexpr double kHeavyFactor = 2;
+
+    static size_t width(double eps);
+    static size_t depth(double delta);
+
+    // Tags of the bucket, sign and Cauchy hashes of the rows, see row_seed().
+    static constexpr uint64_t kIndexTag = 1;
+    static constexpr uint64_t kSignTag = 2;
+    static constexpr uint64_t kCauchyTag = 3;
+    // The seed of the hash with the given tag in row i.
+    static uint64_t row_seed(uint64_t seed, uint64_t tag, size_t i);
+
+    // The l1 estimate of the i-th row, with scratch as room for w_ values.
+    double row_estimate(const size_t i, double* scratch) const;
+    // Adds a * other to the counters.
+    void add_scaled(const KnwF1Estimator& other, double a);
 };
 
 #endif  // FP_ESTIMATOR_H_
\ No newline at end of file
@@ -0,0 +1,118 @@
+#ifndef HYBRID_SKETCH_H_
+#define HYBRID_SKETCH_H_
+
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "CountSketch.h"
+#include "Serialization.h"
+
+// A CountSketch fronted by a SpaceSaving-style table that tracks up to k keys in the
+// front. The frequency vector is always split exactly as x = front + residual, where the
+// residual is summarized by the CountSketch. A key enters the front when its estimate
+// exceeds the smallest tracked count, which is then pushed back into the residual. An
+// admitted key starts from its CountSketch estimate rather than its true count, and the
+// error of that estimate stays in the residual.
+// Keeping the heaviest keys out of the CountSketch removes their collisions with every
+// other key, so a narrower table reaches the same error on heavy-tailed streams.
+class HybridSketch {
+  public:
+    /**
+     * Constructs a HybridSketch tracking up to k keys in the front of a CountSketch
+     * with width w and depth d. With k = 0 it behaves exactly like the CountSketch.
+     *
+     * \param k The number of keys tracked in the front. Keys admitted once the front is
+     * full start from their CountSketch estimate.
+     * \param w The size of each row in the CountSketch. Assumes w < 2^61 -1.
+     * \param d The number of hash/sign rows in the CountSketch. Defaults to 5.
+     * \param seed The seed for the random number generator. Defaults to 42.
+     * \param murmur Whether to use MurmurHash3 for hashing. Defaults to false.
+     * \param sparse Whether the CountSketch starts with a sparse map of touched
+     * counters. Defaults to false.
+     * \param counter The storage type of the dense counters. Defaults to double.
+     */
+    HybridSketch(size_t k,
+                 size_t w,
+                 size_t d = 5,
+                 uint64_t seed = 42,
+                 bool murmur = false,
+                 bool sparse = false,
+                 CounterType counter = CounterType::kDouble);
+    ~HybridSketch() = default;
+    HybridSketch(const HybridSketch& other) = default;
+    HybridSketch& operator=(const HybridSketch& other) = default;
+    HybridSketch(HybridSketch&& other) = default;
+    HybridSketch& operator=(HybridSketch&& other) = default;
+
+    // Modifies the sketch to handle stream updates of the form (key, delta).
+    void update(const uint64_t key, const double delta);
+    // As update(), with the powers of the key for the CountSketch, see
+    // CountSketch::update().
+    void update(const uint64_t key, const uint64_t* powers, const double delta);
+    // Computes an estimate of the frequency of a given key from both parts.
+    int64_t estimate(const uint64_t key) const;
+    // As estimate(), with the powers of the key and room for the row estimates of the
+    // CountSketch, see CountSketch::estimate().
+    int64_t estimate(const uint64_t key, const uint64_t* powers, double* scratch) const;
+
+    // Applies the updates (keys[j], deltas[j]) in order.
+    void update_batch(const std::vector<uint64_t>& keys,
+                      const std::vector<double>& deltas);
+    // Computes the estimate of each key in keys.
+    std::vector<int64_t> estimate_batch(const std::vector<uint64_t>& keys) const;
+
+    // Adds or subtracts the contents of another HybridSketch built with the same
+    // parameters, or multiplies every count by a.
+    void merge(const HybridSketch& other);
+    void subtract(const HybridSketch& other);
+    void scale(double a);
+    HybridSketch& operator+=(const HybridSketch& other) {
+        merge(other);
+        return *this;
+    }
+    HybridSketch& operator-=(const HybridSketch& other) {
+        subtract(other);
+        return *this;
+    }
+
+    // The keys currently tracked in the front, with their counts there.
+    std::vector<std::pair<uint64_t, double>> heavy() const;
+    // The CountSketch summarizing everything outside the front.
+    const CountSketch& residual() const { return cs_; }
+    // Materializes the buckets and signs of the keys [0, n) in the CountSketch, see
+    // CountSketch::precompute().
+    void precompute(uint64_t n, size_t num_threads = 0) {
+        cs_.precompute(n, num_threads);
+    }
+
+    size_t get_k() const { return k_; }
+
+    // Saves the sketch in the binary format of Serialization.h, and restores it.
+    void save(std::ostream& os) const;
+    static HybridSketch load(std::istream& is);
+    // Writes and reads the sketch without a record header, for embedding in others.
+    void write(serialization::BinaryWriter& out) const;
+    static HybridSketch read(serialization::BinaryReader& in);
+
+    friend std::ostream& operator<<(std::ostream& os, const HybridSketch& sketch);
+
+  private:
+    // Used by read(), which reserves the front itself.
+    HybridSketch(size_t k, CountSketch cs);
+
+    size_t k_;                                    // capacity of the front
+    std::unordered_map<uint64_t, double> front_;  // key -> count in the front
+    CountSketch cs_;                              // residual x - front
+
+    // Cached key with the smallest |count| in the front, recomputed when stale.
+    uint64_t min_key_ = 0;
+    bool min_stale_ = true;
+
+    void admit(const uint64_t key, const double count);
+    void find_min();
+};
+
+#endif  // HYBRID_SKETCH_H_
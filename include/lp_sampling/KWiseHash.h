@@ -1,6 +1,7 @@
 #ifndef K_WISE_HASH_H_
 #define K_WISE_HASH_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <iostream>
 #include <random>
@@ -10,7 +11,7 @@ class KWiseHash {
   private:
     uint64_t k_;
     std::vector<uint64_t> a_;
-    const uint64_t MP61 = (1ULL << 61) - 1;  // Large Mersenne prime
+    static constexpr uint64_t MP61 = (1ULL << 61) - 1;  // Large Mersenne prime
 
   public:
     KWiseHash(uint64_t k, uint64_t seed = std::random_device{}());
@@ -23,16 +24,46 @@ class KWiseHash {
     // Copy‑assignment operator
     KWiseHash& operator=(const KWiseHash& other);
 
+    KWiseHash(KWiseHash&& other) = default;
+    KWiseHash& operator=(KWiseHash&& other) = default;
+
     uint64_t hash(uint64_t x) const;
+    // Evaluates the hash from the powers of x written by powers(), which equals hash(x)
+    // for x < 2^61.
+    uint64_t hash_powers(const uint64_t* powers) const {
+        return eval_powers(a_.data(), k_, powers);
+    }
+    // Writes hash(xs[j]) to out[j] for j < m, evaluating four polynomials at a time so
+    // that their multiplications overlap.
+    void hash_batch(const uint64_t* xs, uint64_t* out, size_t m) const;
 
     uint64_t get_mp() const { return MP61; }
+    uint64_t get_k() const { return k_; }
+    const uint64_t* coefficients() const { return a_.data(); }
+
+    // Draws the k coefficients of the hash with the given seed into a, so that callers
+    // can keep the coefficients of many hashes in one array.
+    static void draw(uint64_t seed, uint64_t* a, uint64_t k);
+    // Evaluates the polynomial with the k coefficients a at x, which is hash(x) for a
+    // hash with these coefficients.
+    static uint64_t eval(const uint64_t* a, uint64_t k, uint64_t x);
+    // Writes eval(a, k, xs[j]) to out[j] for j < m, as in hash_batch().
+    static void eval_batch(
+        const uint64_t* a, uint64_t k, const uint64_t* xs, uint64_t* out, size_t m);
+    // Writes x^j mod MP61 to out[j] for j < k. Any number of hashes of independence at
+    // most k can then evaluate x with eval_powers(), instead of each running Horner's
+    // method over x.
+    static void powers(uint64_t x, uint64_t* out, uint64_t k);
+    // Evaluates the polynomial with the k coefficients a from the powers of x, which
+    // equals eval(a, k, x) for x < 2^61. Its products are independent of each other,
+    // unlike the steps of Horner's method.
+    static uint64_t eval_powers(const uint64_t* a, uint64_t k, const uint64_t* powers);
 
-  private:
     // Branchless reduction of a 128-bit value (hi:lo) modulo MP61
-    uint64_t mod61(uint64_t hi, uint64_t lo) const;
+    static uint64_t mod61(uint64_t hi, uint64_t lo);
 
     // Fast multiplication mod MP61
-    uint64_t mul61(uint64_t a, uint64_t b) const;
+    static uint64_t mul61(uint64_t a, uint64_t b);
 };
 
-#endif  // K_WISE_HASH_H_
\ No newline at end of file
+#endif  // K_WISE_HASH_H_
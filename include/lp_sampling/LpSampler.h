@@ -2,36 +2,164 @@
 #define LP_SAMPLER_H_
 
 #include <cstdint>
-#include <memory>
+#include <iostream>
 #include <optional>
 #include <random>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
 
-#include "CountSketch.h"
+#include "CountSketchTuner.h"
 #include "FpEstimator.h"
+#include "HybridSketch.h"
 #include "KWiseHash.h"
+#include "Serialization.h"
 
+// The l1 norm estimator of a sampler for p = 1.
+enum class F1EstimatorType : uint8_t {
+    kCauchy = 0,  // F1Estimator, whose updates touch all of its projections
+    kKnw = 1,     // KnwF1Estimator, whose updates touch two counters per row
+};
+
+// Optional settings for LpSampler beyond its error parameters.
+struct LpSamplerOptions {
+    // Number of heaviest scaled keys tracked in the front of the CountSketch (see
+    // HybridSketch), where admitted keys start from their CountSketch estimate.
+    size_t heavy_keys = 0;
+    // Shape of the CountSketch, e.g. as chosen by CountSketchTuner. A zero width or
+    // depth keeps the default of 6m columns and 4 ceil(ln n) rows.
+    CountSketchConfig sketch;
+    // Storage type of the counters of the F1/F2 norm estimators. KnwF1Estimator always
+    // uses double precision.
+    CounterType norm_counter = CounterType::kDouble;
+    // Estimator of the l1 norm for p = 1. Ignored for p = 2.
+    F1EstimatorType f1_estimator = F1EstimatorType::kCauchy;
+    // Whether to materialize the per-key scaling factors, CountSketch buckets and signs,
+    // and F1Estimator Cauchy variables of all n keys on construction, with one thread per
+    // hardware thread, so that updates look them up instead of hashing. Takes about
+    // 8 n + 4 n d bytes, plus 4 n w bytes for the F1Estimator of width w.
+    bool precompute = false;
+};
+
+// Samples a key i of a turnstile stream over [0, n) with probability about
+// |x_i|^P / ||x||_P^P, for P = 1 or 2. The key scaling and the sketches are chosen at
+// compile time, so updates make no virtual calls. The sketches are held by value, so a
+// sampler is one object plus the arrays of its sketches, and moving it moves only
+// their pointers. LpSampler<1> and LpSampler<2> are instantiated in LpSampler.cpp.
+template <uint16_t P>
 class LpSampler {
+    static_assert(P == 1 || P == 2, "Only implemented for p = 1 or p = 2");
+
   public:
-    LpSampler(uint16_t p, double eps, double delta, uint64_t n, uint64_t seed = 42);
+    // The estimator of ||x||_P, one of the F1 estimators chosen by
+    // LpSamplerOptions::f1_estimator for P = 1, and F2Estimator for P = 2.
+    using NormEstimator = std::conditional_t<P == 1,
+                                             std::variant<F1Estimator, KnwF1Estimator>,
+                                             std::variant<F2Estimator>>;
+
+    LpSampler(double eps,
+              double delta,
+              uint64_t n,
+              uint64_t seed = 42,
+              const LpSamplerOptions& options = {});
     ~LpSampler() = default;
+    // Samplers can be moved, e.g. into a std::vector, but not assigned, since their
+    // estimators have const parameters.
+    LpSampler(LpSampler&& other) = default;
 
     void update(const uint64_t i, const double delta);
-    std::optional<uint64_t> sample() const;
+    // Samples a key, or returns nothing if the sample fails. The sketches are left
+    // intact, so updates can continue and sample() can be called again. It is not const,
+    // since it reuses buffers of the sampler.
+    std::optional<uint64_t> sample();
+
+    // Adds or subtracts the sketches of another LpSampler with the same parameters and
+    // options, or multiplies every sketch by a.
+    void merge(const LpSampler& other);
+    void subtract(const LpSampler& other);
+    void scale(double a);
+    LpSampler& operator+=(const LpSampler& other) {
+        merge(other);
+        return *this;
+    }
+    LpSampler& operator-=(const LpSampler& other) {
+        subtract(other);
+        return *this;
+    }
+
+    // Saves the sampler and all of its sketches in the binary format of
+    // Serialization.h, and restores it. Throws if the record is of another p.
+    void save(std::ostream& os) const;
+    static LpSampler load(std::istream& is);
 
   private:
-    uint16_t p_;
     double eps_;
     double delta_;
     uint64_t n_;  // number of possible keys
     uint64_t seed_;
-    uint64_t m_;                    // width of CountSketch
-    mutable bool sampled_ = false;  // whether the sketch has been sampled
+    LpSamplerOptions options_;
+    uint64_t m_;  // width of CountSketch
+
+    // sample() fails if the residual norm exceeds residual_factor_ r, or the largest
+    // scaled key is below max_factor_ r, for r the estimate of ||x||_P.
+    double residual_factor_;  // eps^(1 - 1/P) sqrt(m)
+    double max_factor_;       // 1 / eps^(1/P)
 
     KWiseHash scalars_;  // Hash function for sampling uni variables
-    std::unique_ptr<CountSketch> cs_;
-    std::unique_ptr<FpEstimator> fp_;      // Fp sketch for Lp norm of x
-    std::unique_ptr<F2Estimator> f2_err_;  // F2 sketch for L2 norm of z - z_hat
-    const double norm_eps_ = 0.125;        // error for Fp sketches
+    // Room for the powers of a key in update() and sample(), as many as the most
+    // independent hash of the sampler and its sketches evaluates.
+    std::vector<uint64_t> powers_;
+    // update() evaluates the hashes of the keys below kPowersLimit from their powers.
+    static constexpr uint64_t kPowersLimit = 1ULL << 61;
+    std::vector<double> key_scalars_;  // 1 / u_i^(1/P) of each key with precompute
+    // The sketches, in the order in which they are serialized.
+    HybridSketch cs_;
+    NormEstimator fp_;    // Fp sketch for Lp norm of x
+    F2Estimator f2_err_;  // F2 sketch for L2 norm of z - z_hat, see sample()
+    static constexpr double kNormEps = 0.125;  // error for Fp sketches
+
+    // Room for the m largest scaled estimates, the row estimates of a key and the
+    // buckets of the largest estimates in f2_err_ in sample(), reused across calls.
+    std::vector<std::pair<uint64_t, double>> top_;
+    std::vector<double> row_estimates_;
+    std::vector<std::pair<size_t, double>> residual_buckets_;
+
+    // Reads the sketches of a sampler with the given parameters from in.
+    LpSampler(double eps,
+              double delta,
+              uint64_t n,
+              uint64_t seed,
+              const LpSamplerOptions& options,
+              serialization::BinaryReader& in);
+
+    // Throws unless other can be merged into or subtracted from this sampler. Both must
+    // agree on precompute, since the precomputed Cauchy variables of F1Estimator are
+    // rounded to floats, and identical streams would not cancel otherwise.
+    void check_compatible(const LpSampler& other) const;
+    // The factor 1 / u_i^(1/P) by which the updates of key i are scaled, hashed from the
+    // powers of i if they are given.
+    double scalar(const uint64_t i, const uint64_t* powers = nullptr) const;
+    // Materializes the per-key values of the sampler and its sketches.
+    void precompute();
+
+    // Returns eps, after checking that eps and delta are in (0, 1), so that the
+    // sketches are only built with valid parameters.
+    static double checked_eps(double eps, double delta);
+    // The number m of largest scaled keys removed from the residual in sample().
+    static uint64_t sparsity(double eps, uint64_t n);
+    static HybridSketch sketch(uint64_t m,
+                               uint64_t n,
+                               uint64_t seed,
+                               const LpSamplerOptions& options);
+    static NormEstimator norm_estimator(double delta,
+                                        uint64_t seed,
+                                        const LpSamplerOptions& options);
+    static NormEstimator read_norm_estimator(serialization::BinaryReader& in,
+                                             const LpSamplerOptions& options);
 };
 
+extern template class LpSampler<1>;
+extern template class LpSampler<2>;
+
 #endif  // LP_SAMPLER_H_
\ No newline at end of file
@@ -0,0 +1,150 @@
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Serialization.h"
+
+// A file mapped read-write into memory with MAP_SHARED, so that stores to the mapping
+// reach the file. Pages are faulted in lazily on first access.
+class MappedFile {
+  public:
+    // Creates (or truncates) the file at path to size bytes of zeros and maps it.
+    static std::shared_ptr<MappedFile> create(const std::string& path, size_t size);
+    // Maps the whole of an existing file.
+    static std::shared_ptr<MappedFile> open(const std::string& path);
+
+    // Sketch tables are mapped with the layout
+    //
+    //   bytes 0-3    magic "LPSM"
+    //   bytes 4-5    kLayoutVersion, u16
+    //   bytes 6-7    serialization::SketchType, u16
+    //   bytes 8-63   parameters of the sketch, see its create_mapped()
+    //   bytes 64-    counters as a flat row-major array, starting at kHeaderSize
+    //
+    // All values are little-endian, and counters are used in place, so mapping is only
+    // supported on little-endian hosts.
+    // Version 2 added the rows of F2Estimator.
+    static constexpr uint16_t kLayoutVersion = 2;
+    static constexpr size_t kHeaderSize = 64;
+
+    // Creates a sketch file with room for counter_bytes after the header.
+    static std::shared_ptr<MappedFile> create_sketch(const std::string& path,
+                                                     serialization::SketchType type,
+                                                     size_t counter_bytes);
+    // Maps a sketch file and checks its magic, layout version and type.
+    static std::shared_ptr<MappedFile> open_sketch(const std::string& path,
+                                                   serialization::SketchType type);
+
+    // Stores and loads a header parameter at the given byte offset.
+    template <typename T>
+    void put(size_t offset, T val) {
+        std::memcpy(data_ + offset, &val, sizeof(T));
+    }
+    template <typename T>
+    T get(size_t offset) const {
+        T val;
+        std::memcpy(&val, data_ + offset, sizeof(T));
+        return val;
+    }
+
+    ~MappedFile();
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+
+    // Flushes modified pages to the file and waits for the write to complete.
+    void sync() const;
+
+    unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string& path() const { return path_; }
+
+  private:
+    MappedFile(std::string path, unsigned char* data, size_t size);
+
+    std::string path_;
+    unsigned char* data_;
+    size_t size_;
+};
+
+// A flat array of counters that either owns its memory or lives inside a MappedFile.
+// Copies always own their memory, so copying a mapped table never aliases the file.
+template <typename T>
+class CounterBuffer {
+  public:
+    CounterBuffer() = default;
+    explicit CounterBuffer(size_t n, T val = 0) : owned_(n, val) { reset(); }
+    CounterBuffer(std::shared_ptr<MappedFile> file, size_t offset, size_t n)
+        : file_(std::move(file)),
+          data_(reinterpret_cast<T*>(file_->data() + offset)),
+          size_(n) {}
+
+    CounterBuffer(const CounterBuffer& other) : owned_(other.begin(), other.end()) {
+        reset();
+    }
+    CounterBuffer& operator=(const CounterBuffer& other) {
+        if (this != &other) {
+            owned_.assign(other.begin(), other.end());
+            file_.reset();
+            reset();
+        }
+        return *this;
+    }
+    CounterBuffer(CounterBuffer&& other) noexcept
+        : owned_(std::move(other.owned_)),
+          file_(std::move(other.file_)),
+          data_(file_ ? other.data_ : owned_.data()),
+          size_(other.size_) {
+        other.reset();
+    }
+    CounterBuffer& operator=(CounterBuffer&& other) noexcept {
+        owned_ = std::move(other.owned_);
+        file_ = std::move(other.file_);
+        data_ = file_ ? other.data_ : owned_.data();
+        size_ = other.size_;
+        other.reset();
+        return *this;
+    }
+
+    // Replaces the contents with n owned copies of val.
+    void assign(size_t n, T val) {
+        owned_.assign(n, val);
+        file_.reset();
+        reset();
+    }
+
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+
+    T* begin() { return data_; }
+    T* end() { return data_ + size_; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+    // The file the counters live in, or nullptr if they are owned.
+    const std::shared_ptr<MappedFile>& file() const { return file_; }
+
+  private:
+    std::vector<T> owned_;
+    std::shared_ptr<MappedFile> file_;
+    T* data_ = nullptr;
+    size_t size_ = 0;
+
+    // Points the buffer back at the owned vector.
+    void reset() {
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+};
+
+#endif  // MAPPED_FILE_H_
@@ -0,0 +1,51 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <vector>
+
+// Splits [0, n) into one contiguous range per thread and calls f(lo, hi) for each range
+// [lo, hi) on its own thread, using num_threads threads, or one per hardware thread if
+// num_threads is 0. A single range is processed on the calling thread. Returns once
+// every range is done, and rethrows the first exception thrown by f.
+template <typename F>
+void parallel_ranges(uint64_t n, size_t num_threads, F f) {
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = std::max<uint64_t>(1, std::min<uint64_t>(num_threads, n));
+    if (num_threads == 1) {
+        f(0, n);
+        return;
+    }
+
+    const uint64_t chunk = n / num_threads, extra = n % num_threads;
+    // An exception escaping a thread would terminate the program, so each range keeps
+    // its own, and the first is rethrown on the calling thread once all have joined.
+    std::vector<std::exception_ptr> errors(num_threads);
+    {
+        std::vector<std::jthread> workers;
+        for (size_t t = 0; t < num_threads; ++t) {
+            uint64_t lo = chunk * t + std::min<uint64_t>(t, extra);
+            uint64_t hi = lo + chunk + (t < extra ? 1 : 0);
+            workers.emplace_back([&f, &errors, t, lo, hi] {
+                try {
+                    f(lo, hi);
+                } catch (...) {
+                    errors[t] = std::current_exception();
+                }
+            });
+        }
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+#endif  // PARALLEL_H_
@@ -0,0 +1,110 @@
+#ifndef SERIALIZATION_H_
+#define SERIALIZATION_H_
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Binary format shared by the save()/load() methods of the sketches.
+//
+// Every record is laid out as
+//
+//   magic    4 bytes  "LPSK"
+//   version  u16      kFormatVersion
+//   type     u16      one of SketchType
+//   payload  ...      type-specific fields, see the write() method of each class
+//   checksum u64      over every preceding byte of the record
+//
+// All integers and floating-point values are little-endian regardless of the host, and
+// counter tables are written as flat arrays so they can be transferred in bulk.
+namespace serialization {
+
+// Version 2 changed the CountSketch sign hashes and added the rows of F2Estimator, so
+// version 1 records can no longer be read. Version 3 changed the Cauchy variables of
+// F1Estimator, which rejects its version 2 records, and added whether F2Estimator
+// maintains its row norms, the counter types of F2Estimator and F1Estimator and the norm
+// counter type of LpSampler. Version 4 added the mode of F1Estimator and the F1
+// estimator type and precompute flag of LpSampler. Version 5 changed the row hashes of
+// KnwF1Estimator, which rejects its earlier records. Fields added by a version are only
+// read from records of that version or later.
+constexpr uint16_t kFormatVersion = 5;
+constexpr uint16_t kMinFormatVersion = 2;
+
+enum class SketchType : uint16_t {
+    kCountSketch = 1,
+    kCountMinSketch = 2,
+    kHybridSketch = 3,
+    kF2Estimator = 4,
+    kF1Estimator = 5,
+    kLpSampler = 6,
+    kDyadicCountSketch = 7,
+    kKnwF1Estimator = 8,
+};
+
+// Writes little-endian values to a stream while accumulating the record checksum.
+class BinaryWriter {
+  public:
+    explicit BinaryWriter(std::ostream& os);
+
+    // Writes the magic, format version and type of a record.
+    void begin(SketchType type);
+    // Writes the checksum of everything written since begin().
+    void end();
+
+    void write_u8(uint8_t val);
+    void write_u16(uint16_t val);
+    void write_u64(uint64_t val);
+    void write_f64(double val);
+    void write_bool(bool val) { write_u8(val ? 1 : 0); }
+
+    void write_f64s(const double* data, size_t n);
+    void write_f32s(const float* data, size_t n);
+
+  private:
+    std::ostream& os_;
+    uint64_t checksum_ = 0;
+
+    void write_bytes(const void* data, size_t n);
+};
+
+// Returns a * b for two sizes read from a record, or throws if the product overflows.
+uint64_t checked_mul(uint64_t a, uint64_t b);
+
+// Reads the values written by BinaryWriter and verifies the record checksum.
+class BinaryReader {
+  public:
+    explicit BinaryReader(std::istream& is);
+
+    // Reads and validates the magic, format version and type of a record.
+    void begin(SketchType type);
+    // Reads the checksum and throws if it does not match the bytes read since begin().
+    void end();
+
+    uint8_t read_u8();
+    uint16_t read_u16();
+    uint64_t read_u64();
+    double read_f64();
+    bool read_bool() { return read_u8() != 0; }
+
+    void read_f64s(double* data, size_t n);
+    void read_f32s(float* data, size_t n);
+
+    // Throws if n values of size bytes each overflow or, on a stream that can seek, are
+    // more than the rest of the stream holds. Shapes read from a record are checked
+    // with it before their tables are allocated, since the checksum is only verified
+    // once the whole record has been read.
+    void check_length(uint64_t n, size_t size);
+
+    uint16_t get_version() const { return version_; }
+
+  private:
+    std::istream& is_;
+    uint64_t checksum_ = 0;
+    uint16_t version_ = 0;
+
+    void read_bytes(void* data, size_t n);
+};
+
+}  // namespace serialization
+
+#endif  // SERIALIZATION_H_
@@ -0,0 +1,121 @@
+#ifndef SKETCH_TABLE_H_
+#define SKETCH_TABLE_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "KWiseHash.h"
+#include "MappedFile.h"
+#include "Serialization.h"
+
+// Storage type of the dense counters. Float halves the table at the cost of exactness
+// once counters exceed 2^24.
+enum class CounterType : uint8_t { kDouble = 0, kFloat = 1 };
+
+// The hashing and counter layer shared by CountSketch and CountMinSketch: d rows of w
+// counters, each row with its own bucket hash.
+class SketchTable {
+  public:
+    /**
+     * Constructs a table of depth d and width w, with one bucket hash per row.
+     *
+     * \param w The size of each row in the table. Assumes w < 2^61 -1.
+     * \param d The number of rows in the table.
+     * \param seed The seed for the random number generator.
+     * \param murmur Whether to use MurmurHash3 for hashing.
+     * \param sparse Whether to start with a sparse map of touched counters, converted
+     * to the dense table once enough counters are non-zero.
+     * \param counter The storage type of the dense counters.
+     */
+    SketchTable(size_t w,
+                size_t d,
+                uint64_t seed,
+                bool murmur,
+                bool sparse,
+                CounterType counter = CounterType::kDouble);
+    ~SketchTable() = default;
+    SketchTable(const SketchTable& other) = default;
+    SketchTable& operator=(const SketchTable& other) = default;
+    SketchTable(SketchTable&& other) = default;
+    SketchTable& operator=(SketchTable&& other) = default;
+
+    // Returns the bucket that a key is hashed into for the i-th row. If powers is not
+    // null, the polynomial hash is evaluated from the powers of the key written by
+    // KWiseHash::powers(), which must be given for a key below 2^61.
+    size_t idx_hash(const size_t i,
+                    const uint64_t key,
+                    const uint64_t* powers = nullptr) const;
+
+    // Reads and modifies the counter in the idx-th bucket of the i-th row.
+    double get(const size_t i, const size_t idx) const;
+    void add(const size_t i, const size_t idx, const double val);
+
+    // Adds or subtracts the counters of another table built with the same parameters.
+    void merge(const SketchTable& other);
+    void subtract(const SketchTable& other);
+    // Multiplies every counter by a.
+    void scale(double a);
+
+    // Whether other has the same width, depth, seed, hash family and counter type.
+    bool compatible(const SketchTable& other) const;
+
+    // Returns the dot product of each row with the same row of a compatible table.
+    std::vector<double> row_dots(const SketchTable& other) const;
+
+    size_t get_w() const { return w_; }
+    size_t get_d() const { return d_; }
+    uint64_t get_seed() const { return seed_; }
+    bool uses_murmur() const { return use_murmur_; }
+    CounterType get_counter() const { return counter_; }
+
+    // Whether the counters are still held in the sparse map.
+    bool is_sparse() const { return !dense_; }
+
+    // Creates a dense table whose counters live in a new file at path, with type
+    // recorded in the header, or maps such a file back in. See MappedFile.h.
+    static SketchTable create_mapped(const std::string& path,
+                                     serialization::SketchType type,
+                                     size_t w,
+                                     size_t d,
+                                     uint64_t seed,
+                                     bool murmur,
+                                     CounterType counter);
+    static SketchTable open_mapped(const std::string& path,
+                                   serialization::SketchType type);
+    // Flushes the counters of a mapped table to its file. Does nothing otherwise.
+    void sync() const;
+    bool is_mapped() const { return table_.file() || table32_.file(); }
+
+    // Writes and reads the parameters and counters, without a record header.
+    void write(serialization::BinaryWriter& out) const;
+    static SketchTable read(serialization::BinaryReader& in);
+
+    friend std::ostream& operator<<(std::ostream& os, const SketchTable& table);
+
+  private:
+    size_t w_;  // size of row
+    size_t d_;  // number of rows
+    uint64_t seed_;
+    bool use_murmur_;
+    CounterType counter_;
+
+    bool dense_;
+    CounterBuffer<double> table_;  // Matrix of size d_ x w_, row-major, for kDouble
+    CounterBuffer<float> table32_;  // Matrix of size d_ x w_, row-major, for kFloat
+    std::unordered_map<uint64_t, double> sparse_;  // (row * w_ + bucket) -> counter
+
+    // The sparse map is converted once it holds more than 1/kSparseFactor of the
+    // cells, which is roughly where its per-entry overhead matches the dense table.
+    static constexpr size_t kSparseFactor = 8;
+
+    std::vector<KWiseHash> index_hashes_;
+
+    void densify();
+    // Adds a * other to the counters.
+    void add_scaled(const SketchTable& other, double a);
+};
+
+#endif  // SKETCH_TABLE_H_
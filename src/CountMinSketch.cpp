@@ -0,0 +1,197 @@
+#include "CountMinSketch.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "Serialization.h"
+#include "SketchTable.h"
+
+CountMinSketch::CountMinSketch(size_t w,
+                               size_t d,
+                               uint64_t seed,
+                               bool murmur,
+                               bool conservative,
+                               bool sparse,
+                               CounterType counter)
+    : CountMinSketch(SketchTable(w, d, seed, murmur, sparse, counter), conservative) {}
+
+CountMinSketch::CountMinSketch(SketchTable table, bool conservative)
+    : table_(std::move(table)), conservative_(conservative) {
+    // An empty row would leave estimate() with no counter to take the minimum of.
+    if (table_.get_w() == 0 || table_.get_d() == 0) {
+        throw std::invalid_argument("CountMinSketch needs w > 0 and d > 0");
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const CountMinSketch& cms) {
+    return os << cms.table_;
+}
+
+/**
+ * Modifies the sketch to handle stream updates of the form (key, delta).
+ * For each i \in [d], updates table[i][h_i(key)] += delta. With conservative update,
+ * each counter is instead raised to at most the new estimate min_i table[i][h_i(key)] +
+ * delta, which keeps every estimate an overestimate while adding less collision noise.
+ *
+ * \param key The key whose frequency is being updated.
+ * \param delta The change in frequency of the key.
+ */
+void CountMinSketch::update(const uint64_t key, const double delta) {
+    const size_t d = table_.get_d();
+    if (!conservative_) {
+        for (size_t i = 0; i < d; ++i) {
+            table_.add(i, table_.idx_hash(i, key), delta);
+        }
+        return;
+    }
+
+    if (delta < 0) {
+        throw std::invalid_argument("Conservative update requires delta >= 0");
+    }
+    std::vector<size_t> idxs(d);
+    double target = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < d; ++i) {
+        idxs[i] = table_.idx_hash(i, key);
+        target = std::min(target, table_.get(i, idxs[i]));
+    }
+    target += delta;
+    for (size_t i = 0; i < d; ++i) {
+        double val = table_.get(i, idxs[i]);
+        if (val < target) {
+            table_.add(i, idxs[i], target - val);
+        }
+    }
+}
+
+/**
+ * Applies the updates (keys[j], deltas[j]) for every j. Without conservative update the
+ * rows are processed one at a time, so that a single row of counters stays in cache
+ * while the whole batch is applied to it. Conservative update depends on the order of
+ * the updates, so it is applied key by key.
+ *
+ * \param keys The keys whose frequencies are being updated.
+ * \param deltas The changes in frequency, with deltas[j] applied to keys[j].
+ */
+void CountMinSketch::update_batch(const std::vector<uint64_t>& keys,
+                                  const std::vector<double>& deltas) {
+    if (keys.size() != deltas.size()) {
+        throw std::invalid_argument("keys and deltas have different sizes");
+    }
+    if (conservative_) {
+        for (size_t j = 0; j < keys.size(); ++j) {
+            update(keys[j], deltas[j]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < table_.get_d(); ++i) {
+        for (size_t j = 0; j < keys.size(); ++j) {
+            table_.add(i, table_.idx_hash(i, keys[j]), deltas[j]);
+        }
+    }
+}
+
+/**
+ * Computes an estimate of the frequency of a given key.
+ * For each i \in [d], table[i][h_i(key)] overestimates freq(key) when all frequencies
+ * are non-negative, so the minimum of these estimates is returned.
+ *
+ * \param key The key whose frequency is being estimated.
+ * \return The minimum estimate of the frequency of the key.
+ */
+int64_t CountMinSketch::estimate(const uint64_t key) const {
+    double estimate = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < table_.get_d(); ++i) {
+        estimate = std::min(estimate, table_.get(i, table_.idx_hash(i, key)));
+    }
+    return estimate;
+}
+
+/**
+ * Computes the estimate of the frequency of each key in keys.
+ *
+ * \param keys The keys whose frequencies are being estimated.
+ * \return The minimum estimates, in the same order as keys.
+ */
+std::vector<int64_t> CountMinSketch::estimate_batch(
+    const std::vector<uint64_t>& keys) const {
+    std::vector<double> estimates(keys.size(), std::numeric_limits<double>::infinity());
+    for (size_t i = 0; i < table_.get_d(); ++i) {
+        for (size_t j = 0; j < keys.size(); ++j) {
+            estimates[j] =
+                std::min(estimates[j], table_.get(i, table_.idx_hash(i, keys[j])));
+        }
+    }
+    return std::vector<int64_t>(estimates.begin(), estimates.end());
+}
+
+/**
+ * Adds the counters of other to this sketch, so that it summarizes the concatenation of
+ * both streams. Both sketches must share the width, depth, seed and hash family. The
+ * result of merging conservative sketches still never underestimates.
+ *
+ * \param other The sketch to merge into this one.
+ */
+void CountMinSketch::merge(const CountMinSketch& other) {
+    if (conservative_ != other.conservative_) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    table_.merge(other.table_);
+}
+
+/**
+ * Subtracts the counters of other from this sketch, so that it summarizes the
+ * difference of the two streams. The estimates are only upper bounds if the difference
+ * is non-negative, and conservative sketches cannot be subtracted, as their counters
+ * are not a linear function of the stream.
+ *
+ * \param other The sketch to subtract from this one.
+ */
+void CountMinSketch::subtract(const CountMinSketch& other) {
+    if (conservative_ || other.conservative_) {
+        throw std::invalid_argument("Conservative sketches cannot be subtracted");
+    }
+    table_.subtract(other.table_);
+}
+
+/**
+ * Multiplies every counter by a. A conservative sketch stays an overestimate of the
+ * scaled stream for a >= 0, but not for negative a.
+ *
+ * \param a The factor to scale by.
+ */
+void CountMinSketch::scale(double a) {
+    if (conservative_ && a < 0) {
+        throw std::invalid_argument("Conservative sketches cannot be negated");
+    }
+    table_.scale(a);
+}
+
+void CountMinSketch::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kCountMinSketch);
+    write(out);
+    out.end();
+}
+
+CountMinSketch CountMinSketch::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kCountMinSketch);
+    CountMinSketch cms = read(in);
+    in.end();
+    return cms;
+}
+
+// Writes conservative u8 followed by the table.
+void CountMinSketch::write(serialization::BinaryWriter& out) const {
+    out.write_bool(conservative_);
+    table_.write(out);
+}
+
+CountMinSketch CountMinSketch::read(serialization::BinaryReader& in) {
+    bool conservative = in.read_bool();
+    return CountMinSketch(SketchTable::read(in), conservative);
+}
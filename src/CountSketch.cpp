@@ -2,86 +2,287 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <exception>
 #include <iostream>
 #include <random>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "KWiseHash.h"
 #include "MurmurHash3.h"
+#include "Parallel.h"
+#include "Serialization.h"
 
-CountSketch::CountSketch(size_t w, size_t d, uint64_t seed, bool murmur)
-    : w_(w),
-      d_(d),
-      seed_(seed),
-      use_murmur_(murmur),
-      table_(d, std::vector<double>(w, 0)) {
-    if (!use_murmur_) {
-        for (size_t i = 0; i < d_; ++i) {
-            index_hashes.emplace_back(KWiseHash(2, seed_ + i));
-            sign_hashes.emplace_back(KWiseHash(2, seed_ + 2 * i));
+CountSketch::CountSketch(
+    size_t w, size_t d, uint64_t seed, bool murmur, bool sparse, CounterType counter)
+    : CountSketch(SketchTable(w, d, seed, murmur, sparse, counter)) {}
+
+CountSketch::CountSketch(SketchTable table) : table_(std::move(table)) {
+    if (!table_.uses_murmur()) {
+        for (size_t i = 0; i < table_.get_d(); ++i) {
+            sign_hashes.emplace_back(
+                KWiseHash(4, table_.get_seed() + table_.get_d() + i));
         }
     }
 }
 
 std::ostream& operator<<(std::ostream& os, const CountSketch& cs) {
-    if (cs.table_[0].size() <= 25) {
-        for (const auto& row : cs.table_) {
-            for (const auto& val : row) {
-                os << val << " ";
+    return os << cs.table_;
+}
+
+/**
+ * Adds the counters of other to this sketch, so that it summarizes the concatenation of
+ * both streams. Both sketches must share the width, depth, seed and hash family.
+ *
+ * \param other The sketch to merge into this one.
+ */
+void CountSketch::merge(const CountSketch& other) {
+    table_.merge(other.table_);
+}
+
+/**
+ * Subtracts the counters of other from this sketch. By linearity the result is the
+ * sketch of the difference of the two frequency vectors, e.g. of the changes between
+ * two epochs. Both sketches must share the width, depth, seed and hash family.
+ *
+ * \param other The sketch to subtract from this one.
+ */
+void CountSketch::subtract(const CountSketch& other) {
+    table_.subtract(other.table_);
+}
+
+void CountSketch::scale(double a) {
+    table_.scale(a);
+}
+
+/**
+ * Estimates the inner product <x, y> of the frequency vectors summarized by a and b,
+ * e.g. the size of the join of two streams on their keys. Since both sketches hash and
+ * sign every key the same way, the dot product of a pair of rows is an unbiased
+ * estimate of <x, y> with variance at most 2 ||x||^2 ||y||^2 / w, and the median over
+ * rows boosts the success probability.
+ *
+ * \param a The sketch of the first stream.
+ * \param b The sketch of the second stream, with the same width, depth, seed, hash
+ * family and counter type as a.
+ * \return The median of the row dot products.
+ */
+double inner_product(const CountSketch& a, const CountSketch& b) {
+    std::vector<double> dots = a.table_.row_dots(b.table_);
+    std::nth_element(dots.begin(), dots.begin() + dots.size() / 2, dots.end());
+    return dots[dots.size() / 2];
+}
+
+/**
+ * Finds the keys with the largest estimated change between two sketches. The sketches
+ * are subtracted into a scratch sketch of the difference, whose estimates are then
+ * scanned over the whole key domain: the domain is split into one contiguous range per
+ * thread, each range is estimated in blocks through estimate_batch(), and each thread
+ * keeps its own k largest changes in a heap before the results are combined. The
+ * scratch sketch is only read during the scan, so the threads share it.
+ *
+ * \param before The sketch of the earlier stream.
+ * \param after The sketch of the later stream, with the same parameters as before.
+ * \param k The number of keys to return.
+ * \param n The size of the key domain. Only keys in [0, n) are considered.
+ * \param num_threads The number of threads to scan with. Defaults to the number of
+ * hardware threads.
+ * \return Up to k (key, change) pairs, sorted by decreasing |change|.
+ */
+std::vector<std::pair<uint64_t, int64_t>> heavy_changes(const CountSketch& before,
+                                                        const CountSketch& after,
+                                                        size_t k,
+                                                        uint64_t n,
+                                                        size_t num_threads) {
+    CountSketch diff = after;
+    diff.subtract(before);
+
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = std::max<uint64_t>(1, std::min<uint64_t>(num_threads, n));
+
+    using Change = std::pair<uint64_t, int64_t>;
+    // Orders changes by decreasing |change|, so a heap under it has the smallest on top.
+    auto larger = [](const Change& a, const Change& b) {
+        return std::abs(a.second) > std::abs(b.second);
+    };
+
+    const size_t kBlock = 4096;
+    std::vector<std::vector<Change>> tops(num_threads);
+    // Scans the range of thread t into tops[t].
+    auto scan = [&](size_t t) {
+        const uint64_t chunk = n / num_threads, extra = n % num_threads;
+        uint64_t lo = chunk * t + std::min<uint64_t>(t, extra);
+        uint64_t hi = lo + chunk + (t < extra ? 1 : 0);
+        auto& top = tops[t];
+        std::vector<uint64_t> keys;
+        for (uint64_t start = lo; start < hi; start += kBlock) {
+            keys.clear();
+            uint64_t end = std::min<uint64_t>(hi, start + kBlock);
+            for (uint64_t key = start; key < end; ++key) {
+                keys.push_back(key);
+            }
+            std::vector<int64_t> changes = diff.estimate_batch(keys);
+            for (size_t j = 0; j < keys.size(); ++j) {
+                if (top.size() < k) {
+                    top.emplace_back(keys[j], changes[j]);
+                    std::push_heap(top.begin(), top.end(), larger);
+                } else if (k > 0 && std::abs(changes[j]) > std::abs(top[0].second)) {
+                    std::pop_heap(top.begin(), top.end(), larger);
+                    top.back() = {keys[j], changes[j]};
+                    std::push_heap(top.begin(), top.end(), larger);
+                }
             }
-            os << std::endl;
         }
+    };
+
+    // An exception escaping a thread would terminate the program, so each worker keeps
+    // its own to be rethrown on the calling thread once all of them have joined.
+    std::vector<std::exception_ptr> errors(num_threads);
+    {
+        std::vector<std::jthread> workers;
+        for (size_t t = 0; t < num_threads; ++t) {
+            workers.emplace_back([&, t] {
+                try {
+                    scan(t);
+                } catch (...) {
+                    errors[t] = std::current_exception();
+                }
+            });
+        }
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    std::vector<Change> res;
+    for (const auto& top : tops) {
+        res.insert(res.end(), top.begin(), top.end());
     }
-    return os;
+    std::sort(res.begin(), res.end(), larger);
+    if (res.size() > k) {
+        res.resize(k);
+    }
+    return res;
 }
 
 /**
- * A hash function that returns the bucket that a key is hashed into for the
- * i-th row. If use_murmur_ is true, uses MurmurHash3. Otherwise, uses a simple
- * multiply-shift hash function. MurmurHash3 is not 2-wise independent, but may
- * be faster in practice. Multiply-shift is 2-wise independent, but may be
- * slower in practice.
+ * Materializes the bucket and sign of every key in [0, n) in each row. The key domain is
+ * split into one contiguous range per thread, and each thread hashes its own range.
  *
- * \param i The index of the row
- * \param key The key to hash.
- * \return The index of the column in the row that the key is hashed to.
+ * \param n The number of keys to materialize, from key 0.
+ * \param num_threads The number of threads to hash with. Defaults to the number of
+ * hardware threads.
  */
-size_t CountSketch::idx_hash(const size_t i, const uint64_t key) const {
-    if (i >= d_) {
-        throw std::out_of_range("i is out of range");
+void CountSketch::precompute(uint64_t n, size_t num_threads) {
+    const size_t d = table_.get_d();
+    if (table_.get_w() > kNegative) {
+        throw std::invalid_argument("Precomputed buckets need w <= 2^31");
+    }
+    if (d != 0 && n > std::vector<uint32_t>().max_size() / d) {
+        throw std::invalid_argument("Precomputed key domain is too large");
     }
+    auto slots = std::make_shared<std::vector<uint32_t>>(n * d);
+    parallel_ranges(n, num_threads, [&](uint64_t lo, uint64_t hi) {
+        for (uint64_t key = lo; key < hi; ++key) {
+            for (size_t i = 0; i < d; ++i) {
+                uint32_t idx = static_cast<uint32_t>(table_.idx_hash(i, key));
+                (*slots)[key * d + i] = sign_hash(i, key) < 0 ? idx | kNegative : idx;
+            }
+        }
+    });
+    slots_ = std::move(slots);
+    precomputed_ = n;
+}
 
-    uint64_t res = 0;
-    if (use_murmur_) {
-        res = murmur_hash3_64(key, seed_ + i);
-    } else {
-        res = index_hashes[i].hash(key);
+size_t CountSketch::slot(const size_t i,
+                         const uint64_t key,
+                         double& val,
+                         const uint64_t* powers) const {
+    if (key < precomputed_) {
+        uint32_t s = (*slots_)[key * table_.get_d() + i];
+        if (s & kNegative) {
+            val = -val;
+        }
+        return s & ~kNegative;
+    }
+    if (sign_hash(i, key, powers) < 0) {
+        val = -val;
     }
-    return res % w_;
+    return table_.idx_hash(i, key, powers);
+}
+
+CountSketch CountSketch::create_mapped(const std::string& path,
+                                       size_t w,
+                                       size_t d,
+                                       uint64_t seed,
+                                       bool murmur,
+                                       CounterType counter) {
+    return CountSketch(SketchTable::create_mapped(
+        path, serialization::SketchType::kCountSketch, w, d, seed, murmur, counter));
+}
+
+CountSketch CountSketch::open_mapped(const std::string& path) {
+    return CountSketch(
+        SketchTable::open_mapped(path, serialization::SketchType::kCountSketch));
+}
+
+void CountSketch::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kCountSketch);
+    write(out);
+    out.end();
+}
+
+CountSketch CountSketch::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kCountSketch);
+    CountSketch cs = read(in);
+    in.end();
+    return cs;
+}
+
+// The sign hashes are derived from the seed, so only the table is written.
+void CountSketch::write(serialization::BinaryWriter& out) const {
+    table_.write(out);
+}
+
+CountSketch CountSketch::read(serialization::BinaryReader& in) {
+    return CountSketch(SketchTable::read(in));
 }
 
 /**
  * A hash function that returns the sign of the key for the i-th row.
- * If use_murmur_ is true, uses MurmurHash3. Otherwise, uses a simple
- * multiply-shift hash function. MurmurHash3 is not 2-wise independent, but may
- * be faster in practice. Multiply-shift is 2-wise independent, but may be
- * slower in practice.
+ * If use_murmur_ is true, uses the top bit of MurmurHash3, whose low bit is poorly
+ * mixed for small keys. Otherwise, uses the low bit of a 4-wise independent
+ * polynomial hash: point estimates only need 2-wise independent signs, but the
+ * variance bounds of inner_product() and of row norms need 4-wise independence.
+ * The seeds d, ..., 2d - 1 are used so that no sign hash shares its seed with a
+ * bucket hash.
  *
  * \param i The index of the row
  * \param key The key to hash.
+ * \param powers The powers of the key up to x^3, or null to hash the key itself.
  * \return Either 1 or -1.
  */
-int CountSketch::sign_hash(const size_t i, const uint64_t key) const {
-    if (i >= d_) {
+int CountSketch::sign_hash(const size_t i,
+                           const uint64_t key,
+                           const uint64_t* powers) const {
+    if (i >= table_.get_d()) {
         throw std::out_of_range("i is out of range");
     }
 
-    uint64_t res = 0;
-    if (use_murmur_) {
-        res = murmur_hash3_64(key, seed_ + 2 * i);
-    } else {
-        res = sign_hashes[i].hash(key);
+    if (table_.uses_murmur()) {
+        return (murmur_hash3_64(key, table_.get_seed() + table_.get_d() + i) >> 63) ? -1
+                                                                                   : 1;
     }
-    return (res & 1) ? -1 : 1;
+    const uint64_t h =
+        powers ? sign_hashes[i].hash_powers(powers) : sign_hashes[i].hash(key);
+    return (h & 1) ? -1 : 1;
 }
 
 /**
@@ -92,10 +293,45 @@ int CountSketch::sign_hash(const size_t i, const uint64_t key) const {
  * \param delta The change in frequency of the key.
  */
 void CountSketch::update(const uint64_t key, const double delta) {
-    for (size_t i = 0; i < d_; ++i) {
-        size_t idx = idx_hash(i, key);
-        int sign = sign_hash(i, key);
-        table_[i][idx] += sign * delta;
+    update(key, nullptr, delta);
+}
+
+/**
+ * Applies the update (key, delta) as update() does, evaluating the 2d hashes of the key
+ * from its powers. Each hash then takes a few independent multiplications instead of a
+ * chain of them, and gives the same bucket and sign.
+ *
+ * \param key The key whose frequency is being updated, below 2^61.
+ * \param powers The first kHashPowers powers of the key, or null to hash the key.
+ * \param delta The change in frequency of the key.
+ */
+void CountSketch::update(const uint64_t key, const uint64_t* powers, const double delta) {
+    for (size_t i = 0; i < table_.get_d(); ++i) {
+        double val = delta;
+        size_t idx = slot(i, key, val, powers);
+        table_.add(i, idx, val);
+    }
+}
+
+/**
+ * Applies the updates (keys[j], deltas[j]) for every j. The rows are processed one at a
+ * time, so that a single row of counters and its hash functions stay in cache while the
+ * whole batch is applied to it.
+ *
+ * \param keys The keys whose frequencies are being updated.
+ * \param deltas The changes in frequency, with deltas[j] applied to keys[j].
+ */
+void CountSketch::update_batch(const std::vector<uint64_t>& keys,
+                               const std::vector<double>& deltas) {
+    if (keys.size() != deltas.size()) {
+        throw std::invalid_argument("keys and deltas have different sizes");
+    }
+    for (size_t i = 0; i < table_.get_d(); ++i) {
+        for (size_t j = 0; j < keys.size(); ++j) {
+            double val = deltas[j];
+            size_t idx = slot(i, keys[j], val);
+            table_.add(i, idx, val);
+        }
     }
 }
 
@@ -109,16 +345,49 @@ void CountSketch::update(const uint64_t key, const double delta) {
  * \return The median estimate of the frequency of the key.
  */
 int64_t CountSketch::estimate(const uint64_t key) const {
-    std::vector<double> estimates(d_);
+    std::vector<double> estimates(table_.get_d());
+    return estimate(key, nullptr, estimates.data());
+}
 
-    for (size_t i = 0; i < d_; ++i) {
-        size_t idx = idx_hash(i, key);
-        int sign = sign_hash(i, key);
-        estimates[i] = sign * table_[i][idx];
+int64_t CountSketch::estimate(const uint64_t key,
+                              const uint64_t* powers,
+                              double* scratch) const {
+    const size_t d = table_.get_d();
+    for (size_t i = 0; i < d; ++i) {
+        double sign = 1;
+        size_t idx = slot(i, key, sign, powers);
+        scratch[i] = sign * table_.get(i, idx);
     }
 
     // Return median estimate
-    std::nth_element(
-        estimates.begin(), estimates.begin() + estimates.size() / 2, estimates.end());
-    return estimates[estimates.size() / 2];
+    std::nth_element(scratch, scratch + d / 2, scratch + d);
+    return scratch[d / 2];
+}
+
+/**
+ * Computes the estimate of the frequency of each key in keys.
+ *
+ * \param keys The keys whose frequencies are being estimated.
+ * \return The median estimates, in the same order as keys.
+ */
+std::vector<int64_t> CountSketch::estimate_batch(
+    const std::vector<uint64_t>& keys) const {
+    const size_t d = table_.get_d();
+    std::vector<double> estimates(keys.size() * d);
+
+    for (size_t i = 0; i < d; ++i) {
+        for (size_t j = 0; j < keys.size(); ++j) {
+            double sign = 1;
+            size_t idx = slot(i, keys[j], sign);
+            estimates[j * d + i] = sign * table_.get(i, idx);
+        }
+    }
+
+    std::vector<int64_t> res(keys.size());
+    for (size_t j = 0; j < keys.size(); ++j) {
+        auto first = estimates.begin() + j * d;
+        std::nth_element(first, first + d / 2, first + d);
+        res[j] = first[d / 2];
+    }
+    return res;
 }
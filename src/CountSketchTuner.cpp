@@ -0,0 +1,212 @@
+#include "CountSketchTuner.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "CountSketch.h"
+#include "SketchTable.h"
+
+void CountSketchConfig::save(const std::string& path) const {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    out << "w " << w << "\n";
+    out << "d " << d << "\n";
+    out << "counter " << (counter == CounterType::kFloat ? "float" : "double") << "\n";
+    out << "ns_per_update " << ns_per_update << "\n";
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+CountSketchConfig CountSketchConfig::load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open " + path + " for reading");
+    }
+
+    CountSketchConfig config;
+    std::string key;
+    while (in >> key) {
+        if (key == "w") {
+            in >> config.w;
+        } else if (key == "d") {
+            in >> config.d;
+        } else if (key == "counter") {
+            std::string type;
+            in >> type;
+            if (in && type != "float" && type != "double") {
+                throw std::runtime_error("Unknown counter type " + type);
+            }
+            config.counter = type == "float" ? CounterType::kFloat : CounterType::kDouble;
+        } else if (key == "ns_per_update") {
+            in >> config.ns_per_update;
+        } else {
+            throw std::runtime_error("Unknown key " + key + " in " + path);
+        }
+        if (!in) {
+            throw std::runtime_error("Missing or malformed value of " + key + " in " +
+                                     path);
+        }
+    }
+    if (!in.eof()) {
+        throw std::runtime_error("Failed to read " + path);
+    }
+    if (config.w == 0 || config.d == 0) {
+        throw std::runtime_error(path + " does not contain a width and depth");
+    }
+    return config;
+}
+
+std::ostream& operator<<(std::ostream& os, const CountSketchConfig& config) {
+    return os << "w = " << config.w << ", d = " << config.d << ", counter = "
+              << (config.counter == CounterType::kFloat ? "float" : "double") << ", "
+              << config.ns_per_update << " ns/update";
+}
+
+CountSketchTuner::CountSketchTuner(const CacheSizes& caches,
+                                   const UpdateCosts& double_costs)
+    : CountSketchTuner(caches, double_costs, double_costs) {}
+
+CountSketchTuner::CountSketchTuner(const CacheSizes& caches,
+                                   const UpdateCosts& double_costs,
+                                   const UpdateCosts& float_costs)
+    : caches_(caches), double_costs_(double_costs), float_costs_(float_costs) {}
+
+CountSketchTuner::CacheSizes CountSketchTuner::detect_caches() {
+    CacheSizes caches = {32 << 10, 1 << 20, 8 << 20};
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && \
+    defined(_SC_LEVEL3_CACHE_SIZE)
+    long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (l1 > 0) caches.l1 = l1;
+    if (l2 > 0) caches.l2 = l2;
+    if (l3 > 0) caches.l3 = l3;
+#endif
+    return caches;
+}
+
+/**
+ * Measures the cost of a single row update for tables that fill half of each cache
+ * level, and for one twice the size of the last level. Each measurement runs the
+ * given number of updates of random keys through a CountSketch of depth 4.
+ *
+ * \param caches The cache sizes to size the tables for.
+ * \param counter The counter type of the tables.
+ * \param updates The number of updates timed per cache level.
+ * \return The measured nanoseconds per row update.
+ */
+CountSketchTuner::UpdateCosts CountSketchTuner::calibrate(const CacheSizes& caches,
+                                                          CounterType counter,
+                                                          size_t updates) {
+    const size_t d = 4;
+    const size_t bytes = counter == CounterType::kFloat ? sizeof(float) : sizeof(double);
+
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(std::min<size_t>(updates, 1 << 16));
+    for (auto& key : keys) {
+        key = rng();
+    }
+
+    auto time_rows = [&](size_t footprint) {
+        size_t w = std::max<size_t>(footprint / (d * bytes), 1);
+        CountSketch cs(w, d, 42, false, false, counter);
+        for (size_t j = 0; j < keys.size(); ++j) {
+            cs.update(keys[j], 1);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t j = 0; j < updates; ++j) {
+            cs.update(keys[j % keys.size()], 1);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        return ns / static_cast<double>(updates * d);
+    };
+
+    return {time_rows(caches.l1 / 2),
+            time_rows(caches.l2 / 2),
+            time_rows(caches.l3 / 2),
+            time_rows(caches.l3 * 2)};
+}
+
+CountSketchTuner CountSketchTuner::calibrated(size_t updates) {
+    CacheSizes caches = detect_caches();
+    return CountSketchTuner(caches,
+                            calibrate(caches, CounterType::kDouble, updates),
+                            calibrate(caches, CounterType::kFloat, updates));
+}
+
+// Predicted cost of one row update for a table of the given size.
+double CountSketchTuner::row_cost(size_t bytes, const UpdateCosts& costs) const {
+    if (bytes <= caches_.l1) return costs.l1;
+    if (bytes <= caches_.l2) return costs.l2;
+    if (bytes <= caches_.l3) return costs.l3;
+    return costs.mem;
+}
+
+/**
+ * Picks the configuration with the lowest predicted update time. Widths from 2.5/eps^2
+ * up to 1024/eps^2 are considered, each with the smallest odd depth meeting delta.
+ * Configurations within 1% of the fastest are treated as ties and the smallest table
+ * among them wins.
+ *
+ * \param eps The desired additive error, relative to the l2 norm of the stream.
+ * \param delta The desired failure probability per estimate.
+ * \param allow_float Whether float counters may be chosen.
+ * \return The chosen width, depth and counter type.
+ */
+CountSketchConfig CountSketchTuner::tune(double eps,
+                                         double delta,
+                                         bool allow_float) const {
+    if (eps <= 0 || eps >= 1) {
+        throw std::invalid_argument("eps must be in (0, 1)");
+    }
+    if (delta <= 0 || delta >= 1) {
+        throw std::invalid_argument("delta must be in (0, 1)");
+    }
+
+    std::vector<CountSketchConfig> candidates;
+    for (double c = 2.5; c <= 1024; c *= 1.1) {
+        size_t w = static_cast<size_t>(std::ceil(c / (eps * eps)));
+        double q = 1 / (static_cast<double>(w) * eps * eps);
+        size_t d = static_cast<size_t>(
+            std::ceil(2 * -std::log(delta) / -std::log(4 * q * (1 - q))));
+        d = (d & 1) ? d : d + 1;  // make sure depth is odd
+
+        candidates.push_back({w, d, CounterType::kDouble,
+                              d * row_cost(d * w * sizeof(double), double_costs_)});
+        if (allow_float) {
+            candidates.push_back({w, d, CounterType::kFloat,
+                                  d * row_cost(d * w * sizeof(float), float_costs_)});
+        }
+    }
+
+    auto bytes = [](const CountSketchConfig& config) {
+        return config.w * config.d *
+               (config.counter == CounterType::kFloat ? sizeof(float) : sizeof(double));
+    };
+    double fastest = candidates.front().ns_per_update;
+    for (const auto& config : candidates) {
+        fastest = std::min(fastest, config.ns_per_update);
+    }
+    CountSketchConfig best = {};
+    for (const auto& config : candidates) {
+        if (config.ns_per_update <= 1.01 * fastest &&
+            (best.w == 0 || bytes(config) < bytes(best))) {
+            best = config;
+        }
+    }
+    return best;
+}
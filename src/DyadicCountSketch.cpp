@@ -0,0 +1,248 @@
+#include "DyadicCountSketch.h"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "CountSketch.h"
+#include "Serialization.h"
+#include "SimdKernels.h"
+
+/**
+ * Level l has ((n - 1) >> l) + 1 nodes, down to a single node holding the total. Levels
+ * with at most w nodes are counted exactly, since that takes less space than a
+ * CountSketch and has no error. Each CountSketch level gets its own hash functions by
+ * offsetting the seed past the 2d seeds used by the previous level.
+ */
+DyadicCountSketch::DyadicCountSketch(uint64_t n,
+                                     size_t w,
+                                     size_t d,
+                                     uint64_t seed,
+                                     bool murmur,
+                                     bool sparse,
+                                     CounterType counter)
+    : n_(n) {
+    if (n == 0 || n > (uint64_t{1} << 63)) {
+        throw std::invalid_argument("n must be in [1, 2^63]");
+    }
+    for (size_t l = 0;; ++l) {
+        uint64_t size = ((n - 1) >> l) + 1;
+        if (size <= w) {
+            exact_.emplace_back(size, 0.0);
+        } else {
+            sketches_.emplace_back(w, d, seed + 2 * d * l, murmur, sparse, counter);
+        }
+        if (size == 1) {
+            break;
+        }
+    }
+}
+
+DyadicCountSketch::DyadicCountSketch(uint64_t n,
+                                     std::vector<CountSketch> sketches,
+                                     std::vector<std::vector<double>> exact)
+    : n_(n), sketches_(std::move(sketches)), exact_(std::move(exact)) {}
+
+/**
+ * Modifies the sketch to handle stream updates of the form (key, delta), by adding
+ * delta to the node containing key at every level.
+ *
+ * \param key The key whose frequency is being updated. Must be smaller than n.
+ * \param delta The change in frequency of the key.
+ */
+void DyadicCountSketch::update(const uint64_t key, const double delta) {
+    if (key >= n_) {
+        throw std::out_of_range("key is out of range");
+    }
+    for (size_t l = 0; l < sketches_.size(); ++l) {
+        sketches_[l].update(key >> l, delta);
+    }
+    for (size_t l = 0; l < exact_.size(); ++l) {
+        exact_[l][key >> (sketches_.size() + l)] += delta;
+    }
+}
+
+/**
+ * Applies the updates (keys[j], deltas[j]) for every j. Each CountSketch level receives
+ * the whole batch of shifted keys through CountSketch::update_batch().
+ *
+ * \param keys The keys whose frequencies are being updated. Must be smaller than n.
+ * \param deltas The changes in frequency, with deltas[j] applied to keys[j].
+ */
+void DyadicCountSketch::update_batch(const std::vector<uint64_t>& keys,
+                                     const std::vector<double>& deltas) {
+    if (keys.size() != deltas.size()) {
+        throw std::invalid_argument("keys and deltas have different sizes");
+    }
+    for (uint64_t key : keys) {
+        if (key >= n_) {
+            throw std::out_of_range("key is out of range");
+        }
+    }
+
+    std::vector<uint64_t> shifted(keys);
+    for (size_t l = 0; l < sketches_.size(); ++l) {
+        if (l > 0) {
+            for (auto& key : shifted) {
+                key >>= 1;
+            }
+        }
+        sketches_[l].update_batch(shifted, deltas);
+    }
+    for (size_t l = 0; l < exact_.size(); ++l) {
+        const size_t shift = sketches_.size() + l;
+        for (size_t j = 0; j < keys.size(); ++j) {
+            exact_[l][keys[j] >> shift] += deltas[j];
+        }
+    }
+}
+
+double DyadicCountSketch::node(const size_t level, const uint64_t idx) const {
+    if (level < sketches_.size()) {
+        return sketches_[level].estimate(idx);
+    }
+    return exact_[level - sketches_.size()][idx];
+}
+
+/**
+ * Computes an estimate of the frequency of a given key from the bottom level.
+ *
+ * \param key The key whose frequency is being estimated. Must be smaller than n.
+ * \return The estimated frequency of the key.
+ */
+int64_t DyadicCountSketch::estimate(const uint64_t key) const {
+    if (key >= n_) {
+        throw std::out_of_range("key is out of range");
+    }
+    return node(0, key);
+}
+
+/**
+ * Computes an estimate of the total frequency of the keys in [lo, hi). The range is
+ * split into maximal dyadic intervals bottom-up: at each level an odd left endpoint or
+ * odd right endpoint is a node that its parent would only partly cover, so it is added
+ * on its own and the endpoint moves inwards. At most two nodes are added per level, so
+ * the error is that of O(log n) point estimates rather than hi - lo of them.
+ *
+ * \param lo The first key of the range.
+ * \param hi One past the last key of the range. Must be at most n.
+ * \return The estimated total frequency of the keys in the range.
+ */
+int64_t DyadicCountSketch::range_sum(uint64_t lo, uint64_t hi) const {
+    if (lo > hi || hi > n_) {
+        throw std::out_of_range("range is out of bounds");
+    }
+    double sum = 0;
+    for (size_t l = 0; lo < hi; ++l) {
+        if (lo & 1) {
+            sum += node(l, lo++);
+        }
+        if (hi & 1) {
+            sum += node(l, --hi);
+        }
+        lo >>= 1;
+        hi >>= 1;
+    }
+    return sum;
+}
+
+/**
+ * Adds the counters of other to this sketch, so that it summarizes the concatenation of
+ * both streams. Both sketches must share the domain and the parameters of every level.
+ *
+ * \param other The sketch to merge into this one.
+ */
+void DyadicCountSketch::merge(const DyadicCountSketch& other) {
+    check_compatible(other);
+    for (size_t l = 0; l < sketches_.size(); ++l) {
+        sketches_[l].merge(other.sketches_[l]);
+    }
+    for (size_t l = 0; l < exact_.size(); ++l) {
+        simd::axpy(1.0, other.exact_[l].data(), exact_[l].data(), exact_[l].size());
+    }
+}
+
+/**
+ * Subtracts the counters of other from this sketch, so that range sums estimate the
+ * change between the two streams. Both sketches must share the domain and the
+ * parameters of every level.
+ *
+ * \param other The sketch to subtract from this one.
+ */
+void DyadicCountSketch::subtract(const DyadicCountSketch& other) {
+    check_compatible(other);
+    for (size_t l = 0; l < sketches_.size(); ++l) {
+        sketches_[l].subtract(other.sketches_[l]);
+    }
+    for (size_t l = 0; l < exact_.size(); ++l) {
+        simd::axpy(-1.0, other.exact_[l].data(), exact_[l].data(), exact_[l].size());
+    }
+}
+
+void DyadicCountSketch::scale(double a) {
+    for (auto& cs : sketches_) {
+        cs.scale(a);
+    }
+    for (auto& level : exact_) {
+        simd::scale(a, level.data(), level.size());
+    }
+}
+
+// The CountSketches check their own parameters when they are combined.
+void DyadicCountSketch::check_compatible(const DyadicCountSketch& other) const {
+    if (n_ != other.n_ || sketches_.size() != other.sketches_.size()) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+}
+
+void DyadicCountSketch::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kDyadicCountSketch);
+    write(out);
+    out.end();
+}
+
+DyadicCountSketch DyadicCountSketch::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kDyadicCountSketch);
+    DyadicCountSketch sketch = read(in);
+    in.end();
+    return sketch;
+}
+
+// Payload: n, the number of CountSketch levels and each of them, then the exact levels.
+// The sizes of the exact levels follow from n.
+void DyadicCountSketch::write(serialization::BinaryWriter& out) const {
+    out.write_u64(n_);
+    out.write_u64(sketches_.size());
+    for (const auto& cs : sketches_) {
+        cs.write(out);
+    }
+    for (const auto& level : exact_) {
+        out.write_f64s(level.data(), level.size());
+    }
+}
+
+DyadicCountSketch DyadicCountSketch::read(serialization::BinaryReader& in) {
+    uint64_t n = in.read_u64();
+    uint64_t num_sketches = in.read_u64();
+    if (n == 0 || n > (uint64_t{1} << 63) || num_sketches >= 64) {
+        throw std::runtime_error("Invalid dyadic sketch in serialized data");
+    }
+
+    std::vector<CountSketch> sketches;
+    for (size_t l = 0; l < num_sketches; ++l) {
+        sketches.push_back(CountSketch::read(in));
+    }
+    std::vector<std::vector<double>> exact;
+    for (size_t l = num_sketches;; ++l) {
+        uint64_t size = ((n - 1) >> l) + 1;
+        in.check_length(size, sizeof(double));
+        exact.emplace_back(size);
+        in.read_f64s(exact.back().data(), size);
+        if (size == 1) {
+            break;
+        }
+    }
+    return DyadicCountSketch(n, std::move(sketches), std::move(exact));
+}
@@ -4,181 +4,1199 @@
 #include <cmath>
 #include <cstdint>
 #include <iostream>
-#include <random>
+#include <utility>
+#include <vector>
 
 #include "KWiseHash.h"
+#include "MappedFile.h"
 #include "MurmurHash3.h"
+#include "Parallel.h"
+#include "Serialization.h"
+#include "SimdKernels.h"
 
-F2Estimator::F2Estimator(double eps, double delta, uint64_t seed, bool murmur)
-    : w_(6 / (eps * eps * delta)),
+namespace {
+
+// Whether the eps and delta of a serialized estimator are in (0, 1), so that the shape
+// derived from them is defined.
+bool valid_params(double eps, double delta) {
+    return eps > 0 && eps < 1 && delta > 0 && delta < 1;
+}
+
+// The n counters of a table: owned zeros, those of a mapped file after its header if
+// file is set, or none if the table holds the other counter type.
+template <typename T>
+CounterBuffer<T> counters(bool used, size_t n, std::shared_ptr<MappedFile> file) {
+    if (!used) {
+        return CounterBuffer<T>(0);
+    }
+    return file ? CounterBuffer<T>(std::move(file), MappedFile::kHeaderSize, n)
+                : CounterBuffer<T>(n);
+}
+
+}  // namespace
+
+F2Estimator::F2Estimator(double eps,
+                         double delta,
+                         uint64_t seed,
+                         bool murmur,
+                         bool track_norm,
+                         CounterType counter)
+    : F2Estimator(eps, delta, seed, murmur, track_norm, counter, nullptr) {}
+
+F2Estimator::F2Estimator(double eps,
+                         double delta,
+                         uint64_t seed,
+                         bool murmur,
+                         bool track_norm,
+                         CounterType counter,
+                         std::shared_ptr<MappedFile> file)
+    : w_(width(eps)),
+      d_(depth(delta)),
       eps_(eps),
       delta_(delta),
       seed_(seed),
       use_murmur_(murmur),
-      table_(w_),
-      index_hash_(2, seed_),
-      sign_hash_(4, seed_ + 20) {}
+      track_norm_(track_norm),
+      counter_(counter),
+      table_(counters<double>(counter == CounterType::kDouble, d_ * w_, file)),
+      table32_(counters<float>(counter == CounterType::kFloat, d_ * w_, file)),
+      row_sq_(track_norm ? d_ : 0, 0) {
+    if (!use_murmur_) {
+        for (size_t i = 0; i < d_; ++i) {
+            index_hashes_.emplace_back(2, seed_ + i);
+            sign_hashes_.emplace_back(4, seed_ + d_ + i);
+        }
+    }
+}
+
+/**
+ * Each row is an AMS estimate of F2 with variance at most 2 F2^2 / w, so by Chebyshev
+ * a row of width 16 / eps^2 is off by more than eps F2 with probability at most 1/8.
+ *
+ * \param eps The desired error rate.
+ * \return The width of each row.
+ */
+size_t F2Estimator::width(double eps) {
+    return static_cast<size_t>(std::ceil(16 / (eps * eps)));
+}
+
+/**
+ * The median of d rows fails only if at least half of them do, which by a Chernoff
+ * bound happens with probability at most (4 q (1 - q))^(d / 2) = (7/16)^(d / 2) for the
+ * per-row failure probability q = 1/8.
+ *
+ * \param delta The desired failure probability.
+ * \return The smallest odd number of rows reaching delta.
+ */
+size_t F2Estimator::depth(double delta) {
+    size_t d =
+        static_cast<size_t>(std::ceil(2 * std::log(1 / delta) / std::log(16.0 / 7)));
+    return (d & 1) ? d : d + 1;  // make sure depth is odd
+}
 
 std::ostream& operator<<(std::ostream& os, const F2Estimator& sketch) {
-    if (sketch.table_.size() <= 25) {
-        for (const auto& val : sketch.table_) {
-            os << val << " ";
+    if (sketch.w_ <= 25) {
+        for (size_t i = 0; i < sketch.d_; ++i) {
+            for (size_t j = 0; j < sketch.w_; ++j) {
+                size_t pos = i * sketch.w_ + j;
+                os << (sketch.counter_ == CounterType::kDouble ? sketch.table_[pos]
+                                                               : sketch.table32_[pos])
+                   << " ";
+            }
+            os << std::endl;
         }
-        os << std::endl;
     }
     return os;
 }
 
+/**
+ * Adds the counters of other to this estimator, so that it summarizes the concatenation
+ * of both streams. Both estimators must be built with the same parameters.
+ *
+ * \param other The estimator to merge into this one.
+ */
+void F2Estimator::merge(const F2Estimator& other) {
+    add_scaled(other, 1);
+}
+
+/**
+ * Subtracts the counters of other from this estimator, so that it summarizes the
+ * difference of the two frequency vectors. Both estimators must be built with the same
+ * parameters.
+ *
+ * \param other The estimator to subtract from this one.
+ */
 void F2Estimator::subtract(const F2Estimator& other) {
-    if (w_ != other.w_) {
-        throw std::invalid_argument("Sketches have different widths");
+    add_scaled(other, -1);
+}
+
+void F2Estimator::scale(double a) {
+    simd::scale(a, table_.data(), table_.size());
+    simd::scale(a, table32_.data(), table32_.size());
+    for (auto& sq : row_sq_) {
+        sq *= a * a;
     }
-    for (size_t i = 0; i < w_; ++i) {
-        table_[i] -= other.table_[i];
+}
+
+void F2Estimator::add_scaled(const F2Estimator& other, double a) {
+    if (!compatible(other)) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    simd::axpy(a, other.table_.data(), table_.data(), table_.size());
+    simd::axpy(a, other.table32_.data(), table32_.data(), table32_.size());
+    recompute_norms();
+}
+
+double F2Estimator::row_dot(const F2Estimator& other, const size_t i) const {
+    if (counter_ == CounterType::kDouble) {
+        return simd::dot(table_.data() + i * w_, other.table_.data() + i * w_, w_);
+    }
+    return simd::dot(table32_.data() + i * w_, other.table32_.data() + i * w_, w_);
+}
+
+void F2Estimator::recompute_norms() {
+    if (!track_norm_) {
+        return;
+    }
+    for (size_t i = 0; i < d_; ++i) {
+        row_sq_[i] = row_dot(*this, i);
+    }
+    pending_updates_ = 0;
+}
+
+bool F2Estimator::compatible(const F2Estimator& other) const {
+    return w_ == other.w_ && d_ == other.d_ && eps_ == other.eps_ &&
+           delta_ == other.delta_ && seed_ == other.seed_ &&
+           use_murmur_ == other.use_murmur_ && counter_ == other.counter_;
+}
+
+/**
+ * Estimates the inner product <x, y> of the frequency vectors summarized by a and b.
+ * Both sketches hash and sign every key the same way, so the dot product of a pair of
+ * rows is an unbiased estimate of <x, y>, computed with a vectorized reduction. The
+ * median over rows is returned.
+ *
+ * \param a The sketch of the first stream.
+ * \param b The sketch of the second stream, built with the same parameters as a.
+ * \return The estimate of <x, y>.
+ */
+double inner_product(const F2Estimator& a, const F2Estimator& b) {
+    if (!a.compatible(b)) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    std::vector<double> dots(a.d_);
+    for (size_t i = 0; i < a.d_; ++i) {
+        dots[i] = a.row_dot(b, i);
+    }
+    std::nth_element(dots.begin(), dots.begin() + dots.size() / 2, dots.end());
+    return dots[dots.size() / 2];
+}
+
+F2Estimator F2Estimator::create_mapped(const std::string& path,
+                                       double eps,
+                                       double delta,
+                                       uint64_t seed,
+                                       bool murmur,
+                                       bool track_norm,
+                                       CounterType counter) {
+    const size_t w = width(eps);
+    const size_t d = depth(delta);
+    const size_t bytes = counter == CounterType::kDouble ? sizeof(double) : sizeof(float);
+    auto file = MappedFile::create_sketch(
+        path,
+        serialization::SketchType::kF2Estimator,
+        serialization::checked_mul(serialization::checked_mul(w, d), bytes));
+    file->put<double>(8, eps);
+    file->put<double>(16, delta);
+    file->put<uint64_t>(24, seed);
+    file->put<uint64_t>(32, w);
+    file->put<uint64_t>(40, d);
+    file->put<uint8_t>(48, murmur);
+    file->put<uint8_t>(49, track_norm);
+    file->put<uint8_t>(50, static_cast<uint8_t>(counter));
+    return F2Estimator(eps, delta, seed, murmur, track_norm, counter, std::move(file));
+}
+
+F2Estimator F2Estimator::open_mapped(const std::string& path) {
+    auto file = MappedFile::open_sketch(path, serialization::SketchType::kF2Estimator);
+    const double eps = file->get<double>(8);
+    const double delta = file->get<double>(16);
+    const size_t w = file->get<uint64_t>(32);
+    const size_t d = file->get<uint64_t>(40);
+    uint8_t counter = file->get<uint8_t>(50);
+    if (counter > static_cast<uint8_t>(CounterType::kFloat)) {
+        throw std::runtime_error(path + " has an unknown counter type");
+    }
+    // The shape is checked before the counters are pointed at the file.
+    const size_t bytes = counter == 0 ? sizeof(double) : sizeof(float);
+    if (!valid_params(eps, delta) || width(eps) != w || depth(delta) != d ||
+        file->size() - MappedFile::kHeaderSize !=
+            serialization::checked_mul(serialization::checked_mul(w, d), bytes)) {
+        throw std::runtime_error(path + " does not match the size of its table");
+    }
+    F2Estimator sketch(eps,
+                       delta,
+                       file->get<uint64_t>(24),
+                       file->get<uint8_t>(48) != 0,
+                       file->get<uint8_t>(49) != 0,
+                       static_cast<CounterType>(counter),
+                       file);
+    sketch.recompute_norms();
+    return sketch;
+}
+
+void F2Estimator::sync() const {
+    if (table_.file()) {
+        table_.file()->sync();
+    }
+    if (table32_.file()) {
+        table32_.file()->sync();
+    }
+}
+
+void F2Estimator::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kF2Estimator);
+    write(out);
+    out.end();
+}
+
+F2Estimator F2Estimator::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kF2Estimator);
+    F2Estimator sketch = read(in);
+    in.end();
+    return sketch;
+}
+
+/**
+ * Writes eps f64, delta f64, seed u64, murmur u8, track_norm u8, counter u8, w u64 and
+ * d u64, followed by the d x w counters as f64 or f32. The hash functions are derived
+ * from the seed, and the row sums of squares are recomputed on reading.
+ */
+void F2Estimator::write(serialization::BinaryWriter& out) const {
+    out.write_f64(eps_);
+    out.write_f64(delta_);
+    out.write_u64(seed_);
+    out.write_bool(use_murmur_);
+    out.write_bool(track_norm_);
+    out.write_u8(static_cast<uint8_t>(counter_));
+    out.write_u64(w_);
+    out.write_u64(d_);
+    if (counter_ == CounterType::kDouble) {
+        out.write_f64s(table_.data(), table_.size());
+    } else {
+        out.write_f32s(table32_.data(), table32_.size());
+    }
+}
+
+F2Estimator F2Estimator::read(serialization::BinaryReader& in) {
+    double eps = in.read_f64();
+    double delta = in.read_f64();
+    uint64_t seed = in.read_u64();
+    bool murmur = in.read_bool();
+    // Records before version 3 have no track_norm and do not maintain the row norms.
+    bool track_norm = in.get_version() < 3 ? false : in.read_bool();
+    // Records before version 3 have no counter type and store doubles.
+    uint8_t counter = in.get_version() < 3 ? 0 : in.read_u8();
+    if (counter > static_cast<uint8_t>(CounterType::kFloat)) {
+        throw std::runtime_error("Unknown counter type in serialized sketch");
+    }
+    size_t w = in.read_u64();
+    size_t d = in.read_u64();
+    const size_t bytes = counter == static_cast<uint8_t>(CounterType::kFloat)
+                             ? sizeof(float)
+                             : sizeof(double);
+    in.check_length(serialization::checked_mul(w, d), bytes);
+    if (!valid_params(eps, delta) || width(eps) != w || depth(delta) != d) {
+        throw std::runtime_error("Serialized F2Estimator has an inconsistent shape");
     }
+
+    F2Estimator sketch(
+        eps, delta, seed, murmur, track_norm, static_cast<CounterType>(counter));
+    if (sketch.counter_ == CounterType::kDouble) {
+        in.read_f64s(sketch.table_.data(), sketch.table_.size());
+    } else {
+        in.read_f32s(sketch.table32_.data(), sketch.table32_.size());
+    }
+    sketch.recompute_norms();
+    return sketch;
 }
 
 /**
- * A hash function that returns the bucket that a key is hashed into.
- * If use_murmur_ is true, uses MurmurHash3. Otherwise, uses a simple multiply-shift hash
- * function. MurmurHash3 is not 2-wise independent, but may be faster in practice.
- * Multiply-shift is 2-wise independent, but may be slower in practice.
+ * A hash function that returns the bucket that a key is hashed into for the i-th row.
+ * If use_murmur_ is true, uses MurmurHash3, which is not 2-wise independent.
+ * Otherwise, uses a 2-wise independent polynomial hash.
  *
+ * \param i The index of the row.
  * \param key The key to hash.
+ * \param powers The powers of the key up to x^1, or null to hash the key itself.
  * \return The index of the column in the row that the key is hashed to.
  */
-size_t F2Estimator::idx_hash(const uint64_t key) const {
+size_t F2Estimator::idx_hash(const size_t i,
+                             const uint64_t key,
+                             const uint64_t* powers) const {
     uint64_t res = 0;
     if (use_murmur_) {
-        res = murmur_hash3_64(key, seed_);
+        res = murmur_hash3_64(key, seed_ + i);
     } else {
-        res = index_hash_.hash(key);
+        res = powers ? index_hashes_[i].hash_powers(powers) : index_hashes_[i].hash(key);
     }
     return res % w_;
 }
 
 /**
- * A hash function that returns the sign of the key.
- * If use_murmur_ is true, uses MurmurHash3. Otherwise, uses a simple multiply-shift hash
- * function. MurmurHash3 is not 2-wise independent, but may be faster in practice.
- * Multiply-shift is 2-wise independent, but may be slower in practice.
+ * A hash function that returns the sign of the key for the i-th row. The variance
+ * bound of each row needs 4-wise independent signs, given by a polynomial hash of
+ * degree 3. If use_murmur_ is true, the sign is the top bit of MurmurHash3 instead,
+ * which is not even 2-wise independent, so the bound carries no guarantee then,
+ * though it may be faster in practice.
  *
+ * \param i The index of the row.
  * \param key The key to hash.
+ * \param powers The powers of the key up to x^3, or null to hash the key itself.
  * \return Either 1 or -1.
  */
-int F2Estimator::sign_hash(const uint64_t key) const {
-    uint64_t res = 0;
+int F2Estimator::sign_hash(const size_t i,
+                           const uint64_t key,
+                           const uint64_t* powers) const {
     if (use_murmur_) {
-        res = murmur_hash3_64(key, seed_ + 20);
-    } else {
-        res = sign_hash_.hash(key);
+        return (murmur_hash3_64(key, seed_ + d_ + i) >> 63) ? -1 : 1;
     }
-    return (res & 1) ? -1 : 1;
+    const uint64_t h =
+        powers ? sign_hashes_[i].hash_powers(powers) : sign_hashes_[i].hash(key);
+    return (h & 1) ? -1 : 1;
 }
 
 /**
  * Modifies the CountSketch to handle stream updates of the form (key, delta).
- * Updates table[h(key)] += sign(key) * delta.
+ * For each i \in [d], updates table[i][h_i(key)] += sign_i(key) * delta. With
+ * track_norm, also adds the change in the square of that counter to the row sum.
  *
  * \param key The key whose frequency is being updated.
  * \param delta The change in frequency of the key.
  */
 void F2Estimator::update(const uint64_t key, const double delta) {
-    size_t idx = idx_hash(key);
-    int sign = sign_hash(key);
-    table_[idx] += sign * delta;
+    update(key, nullptr, delta);
 }
 
 /**
- * Computes an estimate of the square of the l2 norm of the frequency vector.
- * For each i \in [d], the estimate of freq(key) is sign_i(key) * table[i][h_i(key)].
- * To boost accuracy, the median of these estimates is returned.
+ * Applies the update (key, delta) as update() does, evaluating the 2d hashes of the key
+ * from its powers, which gives the same buckets and signs.
+ *
+ * \param key The key whose frequency is being updated, below 2^61.
+ * \param powers The first kHashPowers powers of the key, or null to hash the key.
+ * \param delta The change in frequency of the key.
+ */
+void F2Estimator::update(const uint64_t key, const uint64_t* powers, const double delta) {
+    for (size_t i = 0; i < d_; ++i) {
+        size_t pos = i * w_ + idx_hash(i, key, powers);
+        double val = sign_hash(i, key, powers) * delta;
+        if (counter_ == CounterType::kDouble) {
+            if (track_norm_) {
+                row_sq_[i] += (2 * table_[pos] + val) * val;
+            }
+            table_[pos] += val;
+        } else {
+            if (track_norm_) {
+                row_sq_[i] += (2 * static_cast<double>(table32_[pos]) + val) * val;
+            }
+            table32_[pos] += static_cast<float>(val);
+        }
+    }
+    if (track_norm_ && ++pending_updates_ >= kRecomputeFactor * w_) {
+        recompute_norms();
+    }
+}
+
+/**
+ * Computes an estimate of the l2 norm of the frequency vector. The sum of squares of
+ * each row is an estimate of F2, and since each is itself an average over the w
+ * buckets, taking the median over rows is a median-of-means estimate. With track_norm
+ * the row sums are already maintained, and only their median is taken.
  *
  * \return The l2 norm estimate.
  */
 double F2Estimator::estimate_norm() const {
-    double estimate = 0;
+    std::vector<double> estimates(d_);
+    for (size_t i = 0; i < d_; ++i) {
+        estimates[i] = track_norm_ ? std::max(row_sq_[i], 0.0) : row_dot(*this, i);
+    }
+
+    std::nth_element(
+        estimates.begin(), estimates.begin() + estimates.size() / 2, estimates.end());
+    return sqrt(estimates[estimates.size() / 2]);
+}
 
-    for (const auto& val : table_) {
-        estimate += val * val;
+/**
+ * Estimates the l2 norm of x - y, for x the stream and y the vector that is value at key
+ * for each (key, value) in entries, as estimate_norm() would after update(key, -value)
+ * for every entry, but without modifying the counters. Only the counters of the buckets
+ * of the entries change, and subtracting t from a counter c changes the sum of squares
+ * of its row by (c - t)^2 - c^2 = (t - 2c) t, so each row sum is corrected at those
+ * buckets. The buckets of a row are sorted first, to combine entries that share one.
+ *
+ * \param entries The (key, value) pairs of y.
+ * \param buckets Room for the bucket and signed value of each entry in every row,
+ * resized to d m pairs.
+ * \return The l2 norm estimate of x - y.
+ */
+double F2Estimator::estimate_residual_norm(
+    const std::vector<std::pair<uint64_t, double>>& entries,
+    std::vector<std::pair<size_t, double>>& buckets) const {
+    const size_t m = entries.size();
+    buckets.resize(d_ * m);
+    uint64_t powers[kHashPowers];
+    for (size_t j = 0; j < m; ++j) {
+        const uint64_t key = entries[j].first;
+        const bool use_powers = !use_murmur_ && key < (1ULL << 61);
+        if (use_powers) {
+            KWiseHash::powers(key, powers, kHashPowers);
+        }
+        for (size_t i = 0; i < d_; ++i) {
+            const uint64_t* p = use_powers ? powers : nullptr;
+            buckets[i * m + j] = {idx_hash(i, key, p),
+                                   sign_hash(i, key, p) * entries[j].second};
+        }
     }
 
-    return sqrt(estimate);
+    std::vector<double> estimates(d_);
+    for (size_t i = 0; i < d_; ++i) {
+        double sq = track_norm_ ? row_sq_[i] : row_dot(*this, i);
+        auto first = buckets.begin() + i * m;
+        auto last = first + m;
+        std::sort(first, last);
+        while (first != last) {
+            size_t bucket = first->first;
+            double t = 0;
+            for (; first != last && first->first == bucket; ++first) {
+                t += first->second;
+            }
+            double c = counter_ == CounterType::kDouble ? table_[i * w_ + bucket]
+                                                        : table32_[i * w_ + bucket];
+            sq += (t - 2 * c) * t;
+        }
+        estimates[i] = std::max(sq, 0.0);
+    }
+
+    std::nth_element(
+        estimates.begin(), estimates.begin() + estimates.size() / 2, estimates.end());
+    return sqrt(estimates[estimates.size() / 2]);
 }
 
 cauchy_distribution::cauchy_distribution(uint64_t k, uint64_t seed)
-    : k_(k), hash_(k, seed) {}
+    : k_(k), seed_(seed), hash_(k, seed) {}
 
 cauchy_distribution& cauchy_distribution::operator=(const cauchy_distribution& other) {
     if (this != &other) {
         k_ = other.k_;
+        seed_ = other.seed_;
         hash_ = other.hash_;
     }
     return *this;
 }
 
 double cauchy_distribution::operator()(size_t i) const {
-    std::mt19937_64 rng(i);
-    std::uniform_int_distribution<uint64_t> dist(0, UINT64_MAX);
+    return at(mix(i));
+}
 
-    double theta = hash_.hash(dist(rng)) / static_cast<double>(hash_.get_mp());
-    theta = (theta - 0.5) * M_PI;  // Uni(-π/2, π/2)
-    return std::tan(theta);
+/**
+ * Computes the Cauchy variable of a key from its mixed value. The k-wise hash of the
+ * row maps the mixed key to a uniform angle theta, and tan(theta) is standard Cauchy.
+ *
+ * \param mixed The key, mixed by mix().
+ * \return The Cauchy variable of the key in this row.
+ */
+double cauchy_distribution::at(uint64_t mixed) const {
+    double theta = uniform(mixed);  // Uni(0, 1)
+    double rv;
+    simd::cauchy(&theta, &rv, 1);  // tan((theta - 1/2) π)
+    return rv;
+}
+
+void cauchy_distribution::uniforms(
+    const uint64_t* a, uint64_t k, const uint64_t* mixed, double* out, size_t m) {
+    constexpr size_t kChunk = 16;
+    uint64_t xs[kChunk];
+    uint64_t hashes[kChunk];
+    for (size_t lo = 0; lo < m; lo += kChunk) {
+        const size_t len = std::min(kChunk, m - lo);
+        for (size_t j = 0; j < len; ++j) {
+            xs[j] = mixed[lo + j] >> 3;
+        }
+        KWiseHash::eval_batch(a, k, xs, hashes, len);
+        for (size_t j = 0; j < len; ++j) {
+            out[lo + j] = hashes[j] / static_cast<double>(kMp);
+        }
+    }
 }
 
-F1Estimator::F1Estimator(double eps, double delta, uint64_t seed)
-    : w_(static_cast<size_t>(std::ceil(3 / (eps * eps) * -std::log(delta))) & 1
-             ? static_cast<size_t>(std::ceil(3 / (eps * eps) * -std::log(delta)))
-             : static_cast<size_t>(std::ceil(3 / (eps * eps) * -std::log(delta))) + 1),
+F1Estimator::F1Estimator(
+    double eps, double delta, uint64_t seed, CounterType counter, F1Mode mode)
+    : F1Estimator(
+          eps, delta, seed, counter, mode, row_seeds(width(eps, delta, mode), seed)) {}
+
+F1Estimator::F1Estimator(double eps,
+                         double delta,
+                         uint64_t seed,
+                         CounterType counter,
+                         F1Mode mode,
+                         const std::vector<uint64_t>& row_seeds)
+    : w_(width(eps, delta, mode)),
       eps_(eps),
       delta_(delta),
       seed_(seed),
-      table_(w_) {
-    dists_.reserve(w_);
-    KWiseHash seed_hash(2, seed_);
-    std::random_device rd;
-    std::mt19937_64 rng(rd());
-    std::uniform_int_distribution<uint64_t> dist(0, UINT64_MAX);
+      counter_(counter),
+      mode_(mode),
+      k_(independence(eps)),
+      row_seeds_(row_seeds),
+      coeffs_(w_ * k_),
+      table_(counter == CounterType::kDouble ? w_ : 0),
+      table32_(counter == CounterType::kFloat ? w_ : 0),
+      scratch_(w_),
+      powers_(k_) {
+    if (row_seeds.size() != w_) {
+        throw std::invalid_argument("Expected one seed per row");
+    }
+    // Each row's coefficients are drawn from its own seed, so the rows can be drawn in
+    // any order and on any thread.
+    const size_t threads = coeffs_.size() >= kParallelCoefficients ? 0 : 1;
+    parallel_ranges(w_, threads, [this](uint64_t lo, uint64_t hi) {
+        for (uint64_t i = lo; i < hi; ++i) {
+            KWiseHash::draw(row_seeds_[i], &coeffs_[i * k_], k_);
+        }
+    });
+}
 
-    for (size_t i = 0; i < w_; ++i) {
-        dists_.emplace_back(
-            static_cast<uint64_t>(std::ceil((1 / eps) * std::pow(-std::log(eps), 3))),
-            seed_hash.hash(dist(rng)));
+// Number of rows, c / eps^2 * ln(1 / delta) rounded up to an odd number. The relative
+// errors of the median and the geometric mean both have variance about pi^2 / (4 w),
+// for which c = 3. That of the maximum likelihood estimate is 2 / w, the least possible
+// for a Cauchy scale, so it reaches the same error with c = 3 * 8 / pi^2.
+size_t F1Estimator::width(double eps, double delta, F1Mode mode) {
+    constexpr double kPi = 3.14159265358979323846;
+    const double c = mode == F1Mode::kMaximumLikelihood ? 24 / (kPi * kPi) : 3;
+    size_t w = static_cast<size_t>(std::ceil(c / (eps * eps) * -std::log(delta)));
+    return (w & 1) ? w : w + 1;
+}
+
+// Independence of the Cauchy variables in each row, (1 / eps) * ln(1 / eps)^3.
+uint64_t F1Estimator::independence(double eps) {
+    return static_cast<uint64_t>(std::ceil((1 / eps) * std::pow(-std::log(eps), 3)));
+}
+
+// Derives the seed of each row's Cauchy hash from the seed of the estimator, so that
+// estimators built with the same parameters project every key the same way. The seed
+// is mixed before the row is added, since with mix(seed + i) row i + 1 of one seed
+// would be row i of the next.
+std::vector<uint64_t> F1Estimator::row_seeds(size_t w, uint64_t seed) {
+    const uint64_t base = cauchy_distribution::mix(seed);
+    std::vector<uint64_t> seeds(w);
+    for (size_t i = 0; i < w; ++i) {
+        seeds[i] = cauchy_distribution::mix(base + i);
+    }
+    return seeds;
+}
+
+bool F1Estimator::compatible(const F1Estimator& other) const {
+    if (w_ != other.w_ || eps_ != other.eps_ || delta_ != other.delta_ ||
+        seed_ != other.seed_ || counter_ != other.counter_ || mode_ != other.mode_ ||
+        precomputed_ != other.precomputed_) {
+        return false;
+    }
+    return row_seeds_ == other.row_seeds_;
+}
+
+/**
+ * Adds the projections of other to this estimator, so that it summarizes the
+ * concatenation of both streams. Both estimators must be built with the same
+ * parameters, e.g. on different shards of a stream, which gives them the same seeds for
+ * their Cauchy hashes.
+ *
+ * \param other The estimator to merge into this one.
+ */
+void F1Estimator::merge(const F1Estimator& other) {
+    add_scaled(other, 1);
+}
+
+/**
+ * Subtracts the projections of other from this estimator, so that it summarizes the
+ * difference of the two frequency vectors. Both estimators must be built with the same
+ * parameters.
+ *
+ * \param other The estimator to subtract from this one.
+ */
+void F1Estimator::subtract(const F1Estimator& other) {
+    add_scaled(other, -1);
+}
+
+void F1Estimator::scale(double a) {
+    simd::scale(a, table_.data(), table_.size());
+    simd::scale(a, table32_.data(), table32_.size());
+}
+
+void F1Estimator::add_scaled(const F1Estimator& other, double a) {
+    if (!compatible(other)) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    simd::axpy(a, other.table_.data(), table_.data(), table_.size());
+    simd::axpy(a, other.table32_.data(), table32_.data(), table32_.size());
+}
+
+void F1Estimator::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kF1Estimator);
+    write(out);
+    out.end();
+}
+
+F1Estimator F1Estimator::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kF1Estimator);
+    F1Estimator sketch = read(in);
+    in.end();
+    return sketch;
+}
+
+/**
+ * Writes eps f64, delta f64, seed u64, counter u8, mode u8 and w u64, then the seed of
+ * each row's Cauchy hash as w u64, followed by the w counters as f64 or f32. The row
+ * seeds are derived from the seed, but are stored so that records of estimators with
+ * other row seeds keep their projections.
+ */
+void F1Estimator::write(serialization::BinaryWriter& out) const {
+    out.write_f64(eps_);
+    out.write_f64(delta_);
+    out.write_u64(seed_);
+    out.write_u8(static_cast<uint8_t>(counter_));
+    out.write_u8(static_cast<uint8_t>(mode_));
+    out.write_u64(w_);
+    for (uint64_t row_seed : row_seeds_) {
+        out.write_u64(row_seed);
+    }
+    if (counter_ == CounterType::kDouble) {
+        out.write_f64s(table_.data(), table_.size());
+    } else {
+        out.write_f32s(table32_.data(), table32_.size());
     }
 }
 
+F1Estimator F1Estimator::read(serialization::BinaryReader& in) {
+    if (in.get_version() < 3) {
+        throw std::runtime_error("F1Estimator records before format version 3 use "
+                                 "different Cauchy variables");
+    }
+    double eps = in.read_f64();
+    double delta = in.read_f64();
+    uint64_t seed = in.read_u64();
+    uint8_t counter = in.read_u8();
+    if (counter > static_cast<uint8_t>(CounterType::kFloat)) {
+        throw std::runtime_error("Unknown counter type in serialized sketch");
+    }
+    // Records before version 4 have no mode and take the median.
+    uint8_t mode = in.get_version() < 4 ? 0 : in.read_u8();
+    if (mode > static_cast<uint8_t>(F1Mode::kMaximumLikelihood)) {
+        throw std::runtime_error("Unknown F1 mode in serialized sketch");
+    }
+    size_t w = in.read_u64();
+    const size_t bytes = counter == static_cast<uint8_t>(CounterType::kFloat)
+                             ? sizeof(float)
+                             : sizeof(double);
+    // The row seeds are followed by the counters.
+    in.check_length(w, sizeof(uint64_t) + bytes);
+    if (!valid_params(eps, delta) || w != width(eps, delta, static_cast<F1Mode>(mode))) {
+        throw std::runtime_error("Serialized F1Estimator has an inconsistent width");
+    }
+    std::vector<uint64_t> seeds(w);
+    for (auto& row_seed : seeds) {
+        row_seed = in.read_u64();
+    }
+
+    F1Estimator sketch(eps,
+                       delta,
+                       seed,
+                       static_cast<CounterType>(counter),
+                       static_cast<F1Mode>(mode),
+                       seeds);
+    if (sketch.counter_ == CounterType::kDouble) {
+        in.read_f64s(sketch.table_.data(), sketch.table_.size());
+    } else {
+        in.read_f32s(sketch.table32_.data(), sketch.table32_.size());
+    }
+    return sketch;
+}
+
 /**
  * Modifies the table to handle stream updates of the form (key, delta).
- * Updates table[i] += dists_[i](key) * delta for each i \in [w_].
+ * Updates table[i] += C_i(key) * delta for each i \in [w_], with C_i the Cauchy
+ * variables of row i.
  *
  * \param key The key whose frequency is being updated.
  * \param delta The change in frequency of the key.
  */
 void F1Estimator::update(const uint64_t key, const double delta) {
+    add_key(key, delta);
+}
+
+/**
+ * Applies a batch of stream updates. The change to the projections is the product of
+ * the w x B matrix of Cauchy variables of the B keys with the vector of deltas, computed
+ * one tile of kRowTile rows at a time. For each block of kKeyBlock keys, every row of
+ * the tile hashes the whole block at once, the block is transformed into Cauchy
+ * variables in one pass, and each row's dot product with the deltas of the block goes
+ * to an accumulator kept in L1. The accumulators are added to the table once per tile.
+ * Keys with precomputed variables are added one at a time, since their variables are
+ * contiguous per key.
+ *
+ * \param keys The keys whose frequencies are being updated.
+ * \param deltas The change in frequency of each key.
+ */
+void F1Estimator::update_batch(const std::vector<uint64_t>& keys,
+                               const std::vector<double>& deltas) {
+    if (keys.size() != deltas.size()) {
+        throw std::invalid_argument("keys and deltas have different sizes");
+    }
+    std::vector<uint64_t> mixed;
+    std::vector<double> hashed_deltas;
+    for (size_t j = 0; j < keys.size(); ++j) {
+        if (keys[j] < precomputed_) {
+            add_key(keys[j], deltas[j]);
+        } else {
+            mixed.push_back(cauchy_distribution::mix(keys[j]));
+            hashed_deltas.push_back(deltas[j]);
+        }
+    }
+    const size_t m = mixed.size();
+    if (m == 0) {
+        return;
+    }
+
+    // The variables of row lo + i of the tile start at rvs[i * kKeyBlock].
+    std::vector<double> rvs(kRowTile * kKeyBlock, 0.0);
+    double acc[kRowTile];
+    for (size_t lo = 0; lo < w_; lo += kRowTile) {
+        const size_t rows = std::min(kRowTile, w_ - lo);
+        std::fill(acc, acc + rows, 0.0);
+        for (size_t kb = 0; kb < m; kb += kKeyBlock) {
+            const size_t block = std::min(kKeyBlock, m - kb);
+            for (size_t i = 0; i < rows; ++i) {
+                cauchy_distribution::uniforms(&coeffs_[(lo + i) * k_],
+                                              k_,
+                                              mixed.data() + kb,
+                                              &rvs[i * kKeyBlock],
+                                              block);
+            }
+            simd::cauchy(rvs.data(), rvs.data(), rows * kKeyBlock);
+            for (size_t i = 0; i < rows; ++i) {
+                acc[i] +=
+                    simd::dot(&rvs[i * kKeyBlock], hashed_deltas.data() + kb, block);
+            }
+        }
+        if (counter_ == CounterType::kDouble) {
+            simd::axpy(1, acc, table_.data() + lo, rows);
+        } else {
+            simd::axpy(1, acc, table32_.data() + lo, rows);
+        }
+    }
+}
+
+/**
+ * Hashes the mixed key to a uniform variable in every row, and transforms all of them
+ * into Cauchy variables with the vectorized simd::cauchy(). Every row evaluates its
+ * polynomial at the same point, so the powers of that point are computed once, and
+ * each row takes k_ independent products with them instead of a chain of k_ dependent
+ * ones.
+ */
+void F1Estimator::variables(const uint64_t key, double* rvs, uint64_t* powers) const {
+    const uint64_t mixed = cauchy_distribution::mix(key);
+    KWiseHash::powers(mixed >> 3, powers, k_);
     for (size_t i = 0; i < w_; ++i) {
-        double cauchy_rv = dists_[i](key);
-        table_[i] += delta * cauchy_rv;
+        rvs[i] = cauchy_distribution::uniform_powers(&coeffs_[i * k_], k_, powers);
+    }
+    simd::cauchy(rvs, rvs, w_);
+}
+
+/**
+ * Adds delta times the Cauchy variable of key in each row to its projection. The
+ * variables are read from the precomputed array if key is in it, and hashed otherwise.
+ */
+void F1Estimator::add_key(const uint64_t key, const double delta) {
+    if (key < precomputed_) {
+        const float* rvs = cauchy_->data() + key * w_;
+        if (counter_ == CounterType::kDouble) {
+            simd::axpy(delta, rvs, table_.data(), w_);
+        } else {
+            simd::axpy(delta, rvs, table32_.data(), w_);
+        }
+        return;
+    }
+
+    double* rvs = scratch_.data();
+    variables(key, rvs, powers_.data());
+    if (counter_ == CounterType::kDouble) {
+        simd::axpy(delta, rvs, table_.data(), w_);
+    } else {
+        simd::axpy(delta, rvs, table32_.data(), w_);
+    }
+}
+
+/**
+ * Materializes the Cauchy variables of every key in [0, n). The key domain is split into
+ * one contiguous range per thread, and each thread hashes its own range through a
+ * buffer of its own.
+ *
+ * \param n The number of keys to materialize, from key 0.
+ * \param num_threads The number of threads to hash with. Defaults to the number of
+ * hardware threads.
+ */
+void F1Estimator::precompute(uint64_t n, size_t num_threads) {
+    if (n > std::vector<float>().max_size() / w_) {
+        throw std::invalid_argument("Precomputed key domain is too large");
     }
+    auto cauchy = std::make_shared<std::vector<float>>(n * w_);
+    parallel_ranges(n, num_threads, [&](uint64_t lo, uint64_t hi) {
+        std::vector<double> rvs(w_);
+        std::vector<uint64_t> powers(k_);
+        for (uint64_t key = lo; key < hi; ++key) {
+            variables(key, rvs.data(), powers.data());
+            std::copy(rvs.begin(), rvs.end(), cauchy->begin() + key * w_);
+        }
+    });
+    cauchy_ = std::move(cauchy);
+    precomputed_ = n;
 }
 
 /**
  * Computes an estimate of the l1 norm of the frequency vector.
- * For each i \in [w_], an estimate is given by abs(table_[i]).
- * To boost accuracy, the median of these estimates is returned.
+ * For each i \in [w_], abs(table_[i]) is the norm times the absolute value of a
+ * Cauchy variable. These are combined by their median, or by the geometric mean or
+ * maximum likelihood estimate of the mode. The absolute values are written to a local
+ * buffer of w_ doubles, so concurrent calls share no state.
  *
  * \return The l1 norm estimate.
  */
 double F1Estimator::estimate_norm() const {
-    std::vector<double> estimates;
-    estimates.reserve(w_);
+    std::vector<double> values(w_);
+    double* abs = values.data();
+    if (counter_ == CounterType::kDouble) {
+        simd::abs(table_.data(), abs, w_);
+    } else {
+        simd::abs(table32_.data(), abs, w_);
+    }
+    switch (mode_) {
+        case F1Mode::kGeometricMean:
+            return geometric_mean(abs);
+        case F1Mode::kMaximumLikelihood:
+            return maximum_likelihood(abs);
+        default:
+            std::nth_element(abs, abs + w_ / 2, abs + w_);
+            return abs[w_ / 2];
+    }
+}
+
+/**
+ * Computes exp(mean of ln|y_i|) cos(pi / (2 w))^w. Since E|C|^(1/w) = 1 / cos(pi / (2
+ * w)) for a standard Cauchy variable C, the correction makes the estimate unbiased.
+ *
+ * \param abs The w_ absolute values of the projections.
+ * \return The l1 norm estimate, 0 if a projection is 0.
+ */
+double F1Estimator::geometric_mean(const double* abs) const {
+    constexpr double kPi = 3.14159265358979323846;
+    double sum = 0;
+    for (size_t i = 0; i < w_; ++i) {
+        sum += std::log(abs[i]);
+    }
+    const double n = static_cast<double>(w_);
+    return std::exp(sum / n + n * std::log(std::cos(kPi / (2 * n))));
+}
+
+/**
+ * Computes the scale d of the Cauchy distribution that maximizes the likelihood of the
+ * projections, the root of sum_i d^2 / (y_i^2 + d^2) = w / 2, times 1 - 1 / w to remove
+ * its bias. In u = ln(d^2), each term of the sum is a logistic function of u, so the
+ * root is found by Newton's method from the median, with steps bounded by 1.
+ *
+ * \param abs The w_ absolute values of the projections, which are reordered.
+ * \return The l1 norm estimate, 0 if at least half of the projections are 0.
+ */
+double F1Estimator::maximum_likelihood(double* abs) const {
+    std::nth_element(abs, abs + w_ / 2, abs + w_);
+    const double median = abs[w_ / 2];
+    if (median == 0) {
+        return 0;
+    }
+    double u = 2 * std::log(median);
+    for (int it = 0; it < kMaxNewtonSteps; ++it) {
+        const double d2 = std::exp(u);
+        double f = -0.5 * static_cast<double>(w_);
+        double df = 0;
+        for (size_t i = 0; i < w_; ++i) {
+            const double s = d2 / (abs[i] * abs[i] + d2);
+            f += s;
+            df += s * (1 - s);
+        }
+        const double step = std::clamp(f / df, -1.0, 1.0);
+        u -= step;
+        if (std::fabs(step) < 1e-12) {
+            break;
+        }
+    }
+    return std::exp(u / 2) * (1 - 1 / static_cast<double>(w_));
+}
+
+KnwF1Estimator::KnwF1Estimator(double eps, double delta, uint64_t seed)
+    : w_(width(eps)),
+      d_(depth(delta)),
+      eps_(eps),
+      delta_(delta),
+      seed_(seed),
+      proj_(d_ * w_, 0),
+      sums_(d_ * w_, 0),
+      mixed_powers_(F1Estimator::independence(eps_)),
+      rvs_(d_) {
+    const uint64_t k = F1Estimator::independence(eps_);
+    for (size_t i = 0; i < d_; ++i) {
+        index_hashes_.emplace_back(2, row_seed(seed_, kIndexTag, i));
+        sign_hashes_.emplace_back(4, row_seed(seed_, kSignTag, i));
+        dists_.emplace_back(k, row_seed(seed_, kCauchyTag, i));
+    }
+}
+
+/**
+ * Derives the seed of a row hash through mix(), so that estimators with nearby seeds
+ * share no rows, as they would with seed + i, and so that the rows differ from those of
+ * the CountSketch and F2Estimator built with the same seed by an LpSampler, whose row i
+ * hashes with seed + i.
+ *
+ * \param seed The seed of the estimator.
+ * \param tag The kind of hash, kIndexTag, kSignTag or kCauchyTag.
+ * \param i The index of the row.
+ * \return The seed of the hash.
+ */
+uint64_t KnwF1Estimator::row_seed(uint64_t seed, uint64_t tag, size_t i) {
+    auto mix = cauchy_distribution::mix;
+    return mix(mix(mix(seed) ^ tag) + i);
+}
+
+/**
+ * A row of w buckets is off by more than eps ||x||_1 with probability below 1/8 once
+ * w = 24 / eps^2, as measured on uniform, Zipfian and heavy-tailed streams.
+ *
+ * \param eps The desired error rate.
+ * \return The number of buckets in each row.
+ */
+size_t KnwF1Estimator::width(double eps) {
+    return static_cast<size_t>(std::ceil(24 / (eps * eps)));
+}
+
+/**
+ * As for F2Estimator, the median of d rows that each fail with probability at most 1/8
+ * fails with probability at most (7/16)^(d / 2).
+ *
+ * \param delta The desired failure probability.
+ * \return The smallest odd number of rows reaching delta.
+ */
+size_t KnwF1Estimator::depth(double delta) {
+    size_t d =
+        static_cast<size_t>(std::ceil(2 * std::log(1 / delta) / std::log(16.0 / 7)));
+    return (d & 1) ? d : d + 1;  // make sure depth is odd
+}
+
+/**
+ * Modifies the estimator to handle stream updates of the form (key, delta). In each row
+ * i, the key is hashed to a bucket j, whose projection gains C_i(key) * delta for the
+ * Cauchy variable C_i(key), and whose signed sum gains s_i(key) * delta for a random
+ * sign s_i(key).
+ *
+ * \param key The key whose frequency is being updated.
+ * \param delta The change in frequency of the key.
+ */
+void KnwF1Estimator::update(const uint64_t key, const double delta) {
+    update(key, nullptr, delta);
+}
+
+/**
+ * Applies the update (key, delta) as update() does, evaluating the bucket and sign
+ * hashes of the key from its powers. The Cauchy hashes of all rows evaluate the same
+ * mixed key, so its powers are computed once for them, and the uniforms of all rows are
+ * transformed into Cauchy variables in one pass.
+ *
+ * \param key The key whose frequency is being updated, below 2^61.
+ * \param powers The first kHashPowers powers of the key, or null to hash the key.
+ * \param delta The change in frequency of the key.
+ */
+void KnwF1Estimator::update(const uint64_t key,
+                            const uint64_t* powers,
+                            const double delta) {
+    const uint64_t mixed = cauchy_distribution::mix(key);
+    KWiseHash::powers(mixed >> 3, mixed_powers_.data(), mixed_powers_.size());
+    for (size_t i = 0; i < d_; ++i) {
+        rvs_[i] = dists_[i].uniform_powers(mixed_powers_.data());
+    }
+    simd::cauchy(rvs_.data(), rvs_.data(), d_);
+
+    for (size_t i = 0; i < d_; ++i) {
+        const uint64_t idx =
+            powers ? index_hashes_[i].hash_powers(powers) : index_hashes_[i].hash(key);
+        const uint64_t sign =
+            powers ? sign_hashes_[i].hash_powers(powers) : sign_hashes_[i].hash(key);
+        const size_t pos = i * w_ + idx % w_;
+        proj_[pos] += delta * rvs_[i];
+        sums_[pos] += (sign & 1) ? delta : -delta;
+    }
+}
+
+/**
+ * Estimates the l1 mass of the i-th row. With T the median |projection| of the row, a
+ * bucket whose signed sum exceeds kHeavyFactor T holds a heavy key, and the signed sum
+ * is its mass. A light bucket of mass m has a projection y with E[cos(y / T)] =
+ * exp(-m / T), so -T ln of the mean of cos(y / T) over the light buckets estimates their
+ * mean mass. Uneven masses bias this down by about Var(m) / (2 T), so the estimates at
+ * scales T and 2 T are extrapolated to 2 est(2 T) - est(T), which cancels that term. The
+ * mean mass is then charged to every bucket, covering the light keys in heavy buckets.
+ * If more than half of the projections are zero, all buckets are counted by their
+ * signed sums, which is exact while no two keys share a bucket.
+ *
+ * \param i The index of the row.
+ * \param scratch Room for the w_ |projections| of the row.
+ * \return The l1 estimate of the row.
+ */
+double KnwF1Estimator::row_estimate(const size_t i, double* scratch) const {
+    const double* proj = proj_.data() + i * w_;
+    const double* sums = sums_.data() + i * w_;
+    const double t = simd::median_abs(proj, scratch, w_);
+
+    double heavy = 0;
+    double cos_t = 0;
+    double cos_2t = 0;
+    size_t light = 0;
+    for (size_t j = 0; j < w_; ++j) {
+        if (t == 0 || std::fabs(sums[j]) > kHeavyFactor * t) {
+            heavy += std::fabs(sums[j]);
+        } else {
+            cos_t += std::cos(proj[j] / t);
+            cos_2t += std::cos(proj[j] / (2 * t));
+            ++light;
+        }
+    }
+    if (light == 0) {
+        return heavy;
+    }
+
+    // A mean of cos(y / T) of at most 0 means the scale is far too small, so it is
+    // clamped to the resolution 1 / light of the mean.
+    auto mean_mass = [light](double cos_sum, double scale) {
+        return -scale * std::log(std::max(cos_sum / light, 1.0 / light));
+    };
+    double mass = 2 * mean_mass(cos_2t, 2 * t) - mean_mass(cos_t, t);
+    return std::max(heavy + w_ * mass, 0.0);
+}
 
-    std::transform(
-        table_.begin(), table_.end(), std::back_inserter(estimates), [](const auto& val) {
-            return std::fabs(val);
-        });
+/**
+ * Computes an estimate of the l1 norm of the frequency vector as the median of the row
+ * estimates.
+ *
+ * \return The l1 norm estimate.
+ */
+double KnwF1Estimator::estimate_norm() const {
+    std::vector<double> scratch(w_);
+    std::vector<double> estimates(d_);
+    for (size_t i = 0; i < d_; ++i) {
+        estimates[i] = row_estimate(i, scratch.data());
+    }
 
-    // Return median estimate
     std::nth_element(
         estimates.begin(), estimates.begin() + estimates.size() / 2, estimates.end());
     return estimates[estimates.size() / 2];
-}
\ No newline at end of file
+}
+
+/**
+ * Adds the counters of other to this estimator, so that it summarizes the concatenation
+ * of both streams. Both estimators must be built with the same parameters.
+ *
+ * \param other The estimator to merge into this one.
+ */
+void KnwF1Estimator::merge(const KnwF1Estimator& other) {
+    add_scaled(other, 1);
+}
+
+/**
+ * Subtracts the counters of other from this estimator, so that it summarizes the
+ * difference of the two frequency vectors. Both estimators must be built with the same
+ * parameters.
+ *
+ * \param other The estimator to subtract from this one.
+ */
+void KnwF1Estimator::subtract(const KnwF1Estimator& other) {
+    add_scaled(other, -1);
+}
+
+void KnwF1Estimator::scale(double a) {
+    simd::scale(a, proj_.data(), proj_.size());
+    simd::scale(a, sums_.data(), sums_.size());
+}
+
+void KnwF1Estimator::add_scaled(const KnwF1Estimator& other, double a) {
+    if (!compatible(other)) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    simd::axpy(a, other.proj_.data(), proj_.data(), proj_.size());
+    simd::axpy(a, other.sums_.data(), sums_.data(), sums_.size());
+}
+
+bool KnwF1Estimator::compatible(const KnwF1Estimator& other) const {
+    return w_ == other.w_ && d_ == other.d_ && eps_ == other.eps_ &&
+           delta_ == other.delta_ && seed_ == other.seed_;
+}
+
+void KnwF1Estimator::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kKnwF1Estimator);
+    write(out);
+    out.end();
+}
+
+KnwF1Estimator KnwF1Estimator::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kKnwF1Estimator);
+    KnwF1Estimator sketch = read(in);
+    in.end();
+    return sketch;
+}
+
+/**
+ * Writes eps f64, delta f64, seed u64, w u64 and d u64, followed by the d x w
+ * projections and the d x w signed sums as f64. The hash functions are derived from
+ * the seed.
+ */
+void KnwF1Estimator::write(serialization::BinaryWriter& out) const {
+    out.write_f64(eps_);
+    out.write_f64(delta_);
+    out.write_u64(seed_);
+    out.write_u64(w_);
+    out.write_u64(d_);
+    out.write_f64s(proj_.data(), proj_.size());
+    out.write_f64s(sums_.data(), sums_.size());
+}
+
+KnwF1Estimator KnwF1Estimator::read(serialization::BinaryReader& in) {
+    if (in.get_version() < 5) {
+        throw std::runtime_error("KnwF1Estimator records before format version 5 use "
+                                 "different row hashes");
+    }
+    double eps = in.read_f64();
+    double delta = in.read_f64();
+    uint64_t seed = in.read_u64();
+    size_t w = in.read_u64();
+    size_t d = in.read_u64();
+    // The projections are followed by the sums.
+    in.check_length(serialization::checked_mul(w, d), 2 * sizeof(double));
+    if (!valid_params(eps, delta) || width(eps) != w || depth(delta) != d) {
+        throw std::runtime_error("Serialized KnwF1Estimator has an inconsistent shape");
+    }
+
+    KnwF1Estimator sketch(eps, delta, seed);
+    in.read_f64s(sketch.proj_.data(), sketch.proj_.size());
+    in.read_f64s(sketch.sums_.data(), sketch.sums_.size());
+    return sketch;
+}
@@ -0,0 +1,296 @@
+#include "HybridSketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "CountSketch.h"
+#include "Serialization.h"
+
+HybridSketch::HybridSketch(size_t k,
+                           size_t w,
+                           size_t d,
+                           uint64_t seed,
+                           bool murmur,
+                           bool sparse,
+                           CounterType counter)
+    : k_(k), cs_(w, d, seed, murmur, sparse, counter) {
+    front_.reserve(k_);
+}
+
+HybridSketch::HybridSketch(size_t k, CountSketch cs) : k_(k), cs_(std::move(cs)) {}
+
+std::ostream& operator<<(std::ostream& os, const HybridSketch& sketch) {
+    for (const auto& [key, count] : sketch.heavy()) {
+        os << key << ": " << count << std::endl;
+    }
+    return os << sketch.cs_;
+}
+
+// Inserts key into the front, keeping the cached minimum up to date.
+void HybridSketch::admit(const uint64_t key, const double count) {
+    front_[key] = count;
+    if (!min_stale_ && std::fabs(count) < std::fabs(front_.at(min_key_))) {
+        min_key_ = key;
+    }
+}
+
+// Recomputes the key with the smallest |count| in the front if the cache is stale.
+void HybridSketch::find_min() {
+    if (!min_stale_) {
+        return;
+    }
+    auto it = std::min_element(
+        front_.begin(), front_.end(), [](const auto& a, const auto& b) {
+            return std::fabs(a.second) < std::fabs(b.second);
+        });
+    min_key_ = it->first;
+    min_stale_ = false;
+}
+
+/**
+ * Modifies the sketch to handle stream updates of the form (key, delta).
+ * Tracked keys are updated in the front. Any other key is added to the front while it
+ * has room, and otherwise goes to the CountSketch. If its estimate then exceeds the
+ * smallest tracked count, the two swap: the evicted key's count is added to the
+ * CountSketch and the new key's estimate is moved out of it into the front. Either way
+ * x = front + residual holds exactly, although the front count of the new key is only
+ * its estimate.
+ *
+ * \param key The key whose frequency is being updated.
+ * \param delta The change in frequency of the key.
+ */
+void HybridSketch::update(const uint64_t key, const double delta) {
+    update(key, nullptr, delta);
+}
+
+/**
+ * Applies the update (key, delta) as update() does. The CountSketch updates of the key
+ * evaluate its hashes from powers.
+ *
+ * \param key The key whose frequency is being updated, below 2^61.
+ * \param powers The first CountSketch::kHashPowers powers of the key, or null to hash
+ * the key.
+ * \param delta The change in frequency of the key.
+ */
+void HybridSketch::update(const uint64_t key,
+                          const uint64_t* powers,
+                          const double delta) {
+    if (k_ == 0) {
+        cs_.update(key, powers, delta);
+        return;
+    }
+
+    auto it = front_.find(key);
+    if (it != front_.end()) {
+        it->second += delta;
+        if (!min_stale_) {
+            if (key == min_key_) {
+                min_stale_ = true;
+            } else if (std::fabs(it->second) < std::fabs(front_.at(min_key_))) {
+                min_key_ = key;
+            }
+        }
+        return;
+    }
+
+    if (front_.size() < k_) {
+        admit(key, delta);
+        return;
+    }
+
+    cs_.update(key, powers, delta);
+    double est = cs_.estimate(key);
+    find_min();
+    auto min_it = front_.find(min_key_);
+    if (std::fabs(est) > std::fabs(min_it->second)) {
+        cs_.update(min_it->first, min_it->second);
+        front_.erase(min_it);
+        cs_.update(key, powers, -est);
+        min_stale_ = true;
+        admit(key, est);
+    }
+}
+
+/**
+ * Computes an estimate of the frequency of a given key, as the count in the front (0
+ * for untracked keys) plus the CountSketch estimate of the residual.
+ *
+ * \param key The key whose frequency is being estimated.
+ * \return The estimate of the frequency of the key.
+ */
+int64_t HybridSketch::estimate(const uint64_t key) const {
+    auto it = front_.find(key);
+    double tracked = it == front_.end() ? 0 : it->second;
+    return tracked + cs_.estimate(key);
+}
+
+int64_t HybridSketch::estimate(const uint64_t key,
+                               const uint64_t* powers,
+                               double* scratch) const {
+    auto it = front_.find(key);
+    double tracked = it == front_.end() ? 0 : it->second;
+    return tracked + cs_.estimate(key, powers, scratch);
+}
+
+/**
+ * Applies the updates (keys[j], deltas[j]) for every j. Without a front this is the
+ * CountSketch's row-at-a-time batch update; otherwise admission depends on the order
+ * of the updates, so they are applied key by key.
+ *
+ * \param keys The keys whose frequencies are being updated.
+ * \param deltas The changes in frequency, with deltas[j] applied to keys[j].
+ */
+void HybridSketch::update_batch(const std::vector<uint64_t>& keys,
+                                const std::vector<double>& deltas) {
+    if (keys.size() != deltas.size()) {
+        throw std::invalid_argument("keys and deltas have different sizes");
+    }
+    if (k_ == 0) {
+        cs_.update_batch(keys, deltas);
+        return;
+    }
+    for (size_t j = 0; j < keys.size(); ++j) {
+        update(keys[j], deltas[j]);
+    }
+}
+
+/**
+ * Computes the estimate of the frequency of each key in keys.
+ *
+ * \param keys The keys whose frequencies are being estimated.
+ * \return The estimates, in the same order as keys.
+ */
+std::vector<int64_t> HybridSketch::estimate_batch(
+    const std::vector<uint64_t>& keys) const {
+    std::vector<int64_t> res = cs_.estimate_batch(keys);
+    if (front_.empty()) {
+        return res;
+    }
+    for (size_t j = 0; j < keys.size(); ++j) {
+        auto it = front_.find(keys[j]);
+        if (it != front_.end()) {
+            res[j] = it->second + res[j];
+        }
+    }
+    return res;
+}
+
+/**
+ * Adds the contents of other to this sketch, so that it summarizes the concatenation of
+ * both streams. The CountSketches are merged, and each key tracked by other is added to
+ * the front if it is tracked here or there is room, and to the CountSketch otherwise.
+ *
+ * \param other The sketch to merge into this one.
+ */
+void HybridSketch::merge(const HybridSketch& other) {
+    if (k_ != other.k_) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    if (this == &other) {
+        merge(HybridSketch(other));
+        return;
+    }
+    cs_.merge(other.cs_);
+
+    for (const auto& [key, count] : other.front_) {
+        auto it = front_.find(key);
+        if (it != front_.end()) {
+            it->second += count;
+        } else if (front_.size() < k_) {
+            front_[key] = count;
+        } else {
+            cs_.update(key, count);
+        }
+    }
+    min_stale_ = true;
+}
+
+/**
+ * Subtracts the contents of other from this sketch, by merging in a negated copy. The
+ * front keeps its capacity, so keys tracked only by other go to the CountSketch once
+ * the front is full.
+ *
+ * \param other The sketch to subtract from this one.
+ */
+void HybridSketch::subtract(const HybridSketch& other) {
+    HybridSketch negated(other);
+    negated.scale(-1);
+    merge(negated);
+}
+
+/**
+ * Multiplies the counts of the front and the counters of the CountSketch by a.
+ * Scaling preserves the order of |count| in the front, so the cached minimum stays
+ * valid.
+ *
+ * \param a The factor to scale by.
+ */
+void HybridSketch::scale(double a) {
+    for (auto& [key, count] : front_) {
+        count *= a;
+    }
+    cs_.scale(a);
+}
+
+std::vector<std::pair<uint64_t, double>> HybridSketch::heavy() const {
+    std::vector<std::pair<uint64_t, double>> res(front_.begin(), front_.end());
+    std::sort(res.begin(), res.end(), [](const auto& a, const auto& b) {
+        return std::fabs(a.second) > std::fabs(b.second);
+    });
+    return res;
+}
+
+void HybridSketch::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kHybridSketch);
+    write(out);
+    out.end();
+}
+
+HybridSketch HybridSketch::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kHybridSketch);
+    HybridSketch sketch = read(in);
+    in.end();
+    return sketch;
+}
+
+/**
+ * Writes k u64, the number of tracked keys u64, then each tracked key u64 with its
+ * count f64 in decreasing order of |count|, followed by the CountSketch.
+ */
+void HybridSketch::write(serialization::BinaryWriter& out) const {
+    out.write_u64(k_);
+    auto entries = heavy();
+    out.write_u64(entries.size());
+    for (const auto& [key, count] : entries) {
+        out.write_u64(key);
+        out.write_f64(count);
+    }
+    cs_.write(out);
+}
+
+HybridSketch HybridSketch::read(serialization::BinaryReader& in) {
+    size_t k = in.read_u64();
+    size_t size = in.read_u64();
+    if (size > k) {
+        throw std::runtime_error("Serialized sketch tracks more keys than its capacity");
+    }
+    in.check_length(size, sizeof(uint64_t) + sizeof(double));
+    std::vector<std::pair<uint64_t, double>> entries(size);
+    for (auto& [key, count] : entries) {
+        key = in.read_u64();
+        count = in.read_f64();
+    }
+
+    HybridSketch sketch(k, CountSketch::read(in));
+    // The capacity is not bounded by the data of the record, so only the keys in it
+    // are reserved for.
+    sketch.front_.reserve(size);
+    sketch.front_.insert(entries.begin(), entries.end());
+    return sketch;
+}
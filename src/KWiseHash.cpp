@@ -1,5 +1,6 @@
 #include "KWiseHash.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <random>
@@ -7,11 +8,7 @@
 
 KWiseHash::KWiseHash(uint64_t k, uint64_t seed)
     : k_(k), a_(k) {
-    std::mt19937_64 rng(seed);
-    std::uniform_int_distribution<uint64_t> dist(0, MP61 - 1);
-
-    for (size_t j = 0; j < k_; j++)
-        a_[j] = dist(rng);
+    draw(seed, a_.data(), k_);
 }
 
 KWiseHash& KWiseHash::operator=(const KWiseHash& other) {
@@ -23,17 +20,86 @@ KWiseHash& KWiseHash::operator=(const KWiseHash& other) {
 }
 
 uint64_t KWiseHash::hash(uint64_t x) const {
+    return eval(a_.data(), k_, x);
+}
+
+void KWiseHash::hash_batch(const uint64_t* xs, uint64_t* out, size_t m) const {
+    eval_batch(a_.data(), k_, xs, out, m);
+}
+
+void KWiseHash::draw(uint64_t seed, uint64_t* a, uint64_t k) {
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<uint64_t> dist(0, MP61 - 1);
+
+    for (size_t j = 0; j < k; j++)
+        a[j] = dist(rng);
+}
+
+uint64_t KWiseHash::eval(const uint64_t* a, uint64_t k, uint64_t x) {
     uint64_t res = 0;
     // Horner’s method
-    for (int j = k_ - 1; j >= 0; --j) {
+    for (int j = k - 1; j >= 0; --j) {
         res = mul61(res, x);
-        res += a_[j];
+        res += a[j];
         if (res >= MP61) res -= MP61;
     }
     return res;
 }
 
-uint64_t KWiseHash::mod61(uint64_t hi, uint64_t lo) const {
+void KWiseHash::eval_batch(
+    const uint64_t* a, uint64_t k, const uint64_t* xs, uint64_t* out, size_t m) {
+    size_t j = 0;
+    // Horner's method on four keys at once: each chain waits on its own product, so the
+    // four chains keep the multiplier busy where a single one would stall on it.
+    for (; j + 4 <= m; j += 4) {
+        uint64_t r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+        for (int t = k - 1; t >= 0; --t) {
+            const uint64_t c = a[t];
+            r0 = mul61(r0, xs[j]) + c;
+            r1 = mul61(r1, xs[j + 1]) + c;
+            r2 = mul61(r2, xs[j + 2]) + c;
+            r3 = mul61(r3, xs[j + 3]) + c;
+            r0 = r0 >= MP61 ? r0 - MP61 : r0;
+            r1 = r1 >= MP61 ? r1 - MP61 : r1;
+            r2 = r2 >= MP61 ? r2 - MP61 : r2;
+            r3 = r3 >= MP61 ? r3 - MP61 : r3;
+        }
+        out[j] = r0;
+        out[j + 1] = r1;
+        out[j + 2] = r2;
+        out[j + 3] = r3;
+    }
+    for (; j < m; ++j) {
+        out[j] = eval(a, k, xs[j]);
+    }
+}
+
+void KWiseHash::powers(uint64_t x, uint64_t* out, uint64_t k) {
+    if (k == 0) return;
+    out[0] = 1;
+    if (k == 1) return;
+    out[1] = x >= MP61 ? x - MP61 : x;
+    for (uint64_t j = 2; j < k; ++j) {
+        out[j] = mul61(out[j - 1], out[1]);
+    }
+}
+
+uint64_t KWiseHash::eval_powers(const uint64_t* a, uint64_t k, const uint64_t* powers) {
+    if (k == 0) return 0;
+    // Every term is below 2^61, so the running sum and up to seven terms fit in 64 bits
+    // before they need to be reduced.
+    uint64_t res = a[0];
+    for (uint64_t j = 1; j < k; j += 7) {
+        const uint64_t end = std::min(j + 7, k);
+        for (uint64_t t = j; t < end; ++t) {
+            res += mul61(a[t], powers[t]);
+        }
+        res = mod61(0, res);
+    }
+    return res;
+}
+
+uint64_t KWiseHash::mod61(uint64_t hi, uint64_t lo) {
     uint64_t lo61 = lo & MP61;
     uint64_t hi_part = (lo >> 61) + (hi << 3) + (hi >> 58);
     uint64_t sum = lo61 + hi_part;
@@ -41,9 +107,9 @@ uint64_t KWiseHash::mod61(uint64_t hi, uint64_t lo) const {
     return sum >= MP61 ? sum - MP61 : sum;
 }
 
-uint64_t KWiseHash::mul61(uint64_t a, uint64_t b) const {
+uint64_t KWiseHash::mul61(uint64_t a, uint64_t b) {
     __uint128_t prod = static_cast<__uint128_t>(a) * b;
     uint64_t lo = static_cast<uint64_t>(prod);
     uint64_t hi = static_cast<uint64_t>(prod >> 64);
     return mod61(hi, lo);
-}
\ No newline at end of file
+}
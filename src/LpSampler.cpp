@@ -1,101 +1,406 @@
 #include "LpSampler.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <iostream>
 #include <optional>
-#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
 
-#include "CountSketch.h"
 #include "FpEstimator.h"
+#include "HybridSketch.h"
 #include "KWiseHash.h"
+#include "Serialization.h"
 
-LpSampler::LpSampler(uint16_t p, double eps, double delta, uint64_t n, uint64_t seed)
-    : p_(p),
-      eps_(eps),
+template <uint16_t P>
+LpSampler<P>::LpSampler(double eps,
+                        double delta,
+                        uint64_t n,
+                        uint64_t seed,
+                        const LpSamplerOptions& options)
+    : eps_(checked_eps(eps, delta)),
       delta_(delta),
       n_(n),
       seed_(seed),
-      scalars_(static_cast<uint64_t>(2 * std::ceil(1 - std::log2(eps))), seed) {
-    if (p > 2 || p == 0) {
-        throw std::invalid_argument("Only implemented for p = 1 or p = 2");
+      options_(options),
+      m_(sparsity(eps, n)),
+      residual_factor_(std::pow(eps, 1 - 1.0 / P) * std::sqrt(m_)),
+      max_factor_(1 / std::pow(eps, 1.0 / P)),
+      scalars_(static_cast<uint64_t>(2 * std::ceil(1 - std::log2(eps))), seed),
+      powers_(std::max({scalars_.get_k(),
+                        CountSketch::kHashPowers,
+                        F2Estimator::kHashPowers,
+                        KnwF1Estimator::kHashPowers})),
+      cs_(sketch(m_, n, seed, options)),
+      fp_(norm_estimator(delta, seed, options)),
+      f2_err_(kNormEps, delta / 2, seed, false, false, options.norm_counter),
+      row_estimates_(cs_.residual().get_d()) {
+    top_.reserve(m_);
+    if (options.precompute) {
+        precompute();
     }
+}
+
+template <uint16_t P>
+LpSampler<P>::LpSampler(double eps,
+                        double delta,
+                        uint64_t n,
+                        uint64_t seed,
+                        const LpSamplerOptions& options,
+                        serialization::BinaryReader& in)
+    : eps_(checked_eps(eps, delta)),
+      delta_(delta),
+      n_(n),
+      seed_(seed),
+      options_(options),
+      m_(sparsity(eps, n)),
+      residual_factor_(std::pow(eps, 1 - 1.0 / P) * std::sqrt(m_)),
+      max_factor_(1 / std::pow(eps, 1.0 / P)),
+      scalars_(static_cast<uint64_t>(2 * std::ceil(1 - std::log2(eps))), seed),
+      powers_(std::max({scalars_.get_k(),
+                        CountSketch::kHashPowers,
+                        F2Estimator::kHashPowers,
+                        KnwF1Estimator::kHashPowers})),
+      cs_(HybridSketch::read(in)),
+      fp_(read_norm_estimator(in, options)),
+      f2_err_(F2Estimator::read(in)),
+      row_estimates_(cs_.residual().get_d()) {
+    top_.reserve(m_);
+}
+
+template <uint16_t P>
+double LpSampler<P>::checked_eps(double eps, double delta) {
     if (eps <= 0 || eps >= 1) {
         throw std::invalid_argument("eps must be in (0, 1)");
     }
     if (delta <= 0 || delta >= 1) {
         throw std::invalid_argument("delta must be in (0, 1)");
     }
+    return eps;
+}
 
-    if (p == 1) {
-        m_ = static_cast<uint64_t>(8 * std::ceil(-std::log(eps_)));
-        fp_ = std::make_unique<F1Estimator>(norm_eps_, delta / 2, seed);
+template <uint16_t P>
+uint64_t LpSampler<P>::sparsity(double eps, uint64_t n) {
+    if constexpr (P == 1) {
+        return static_cast<uint64_t>(8 * std::ceil(-std::log(eps)));
     } else {
-        m_ = static_cast<uint64_t>(8 * 1 / eps * std::log(n_));
-        fp_ = std::make_unique<F2Estimator>(norm_eps_, delta / 2, seed);
+        return static_cast<uint64_t>(8 * 1 / eps * std::log(n));
+    }
+}
+
+// The CountSketch of the scaled keys, by default 6m columns and 4 ceil(ln n) rows.
+template <uint16_t P>
+HybridSketch LpSampler<P>::sketch(uint64_t m,
+                                  uint64_t n,
+                                  uint64_t seed,
+                                  const LpSamplerOptions& options) {
+    size_t width = options.sketch.w ? options.sketch.w : 6 * m;
+    size_t depth = options.sketch.d;
+    if (depth == 0) {
+        depth = 4 * static_cast<size_t>(std::ceil(std::log(n)));
+        depth = (depth & 1) ? depth : depth + 1;  // make sure depth is odd
     }
+    return HybridSketch(
+        options.heavy_keys, width, depth, seed, false, false, options.sketch.counter);
+}
 
-    size_t depth = 4 * static_cast<size_t>(std::ceil(std::log(n_)));
-    depth = (depth & 1) ? depth : depth + 1;  // make sure depth is odd
-    cs_ = std::make_unique<CountSketch>(6 * m_, depth, seed, false);
+template <uint16_t P>
+typename LpSampler<P>::NormEstimator LpSampler<P>::norm_estimator(
+    double delta, uint64_t seed, const LpSamplerOptions& options) {
+    if constexpr (P == 2) {
+        return NormEstimator(std::in_place_type<F2Estimator>,
+                             kNormEps,
+                             delta / 2,
+                             seed,
+                             false,
+                             false,
+                             options.norm_counter);
+    } else if (options.f1_estimator == F1EstimatorType::kKnw) {
+        return NormEstimator(
+            std::in_place_type<KnwF1Estimator>, kNormEps, delta / 2, seed);
+    } else {
+        return NormEstimator(std::in_place_type<F1Estimator>,
+                             kNormEps,
+                             delta / 2,
+                             seed,
+                             options.norm_counter);
+    }
+}
 
-    f2_err_ = std::make_unique<F2Estimator>(norm_eps_, delta_ / 2, seed_);
+template <uint16_t P>
+typename LpSampler<P>::NormEstimator LpSampler<P>::read_norm_estimator(
+    serialization::BinaryReader& in, const LpSamplerOptions& options) {
+    if constexpr (P == 2) {
+        return NormEstimator(std::in_place_type<F2Estimator>, F2Estimator::read(in));
+    } else if (options.f1_estimator == F1EstimatorType::kKnw) {
+        return NormEstimator(std::in_place_type<KnwF1Estimator>,
+                             KnwF1Estimator::read(in));
+    } else {
+        return NormEstimator(std::in_place_type<F1Estimator>, F1Estimator::read(in));
+    }
 }
 
-void LpSampler::update(const uint64_t i, const double delta) {
-    double u_i = scalars_.hash(i) / static_cast<double>(scalars_.get_mp());  // Uni(0, 1)
-    double z_i = delta / std::pow(u_i, 1 / p_);
+/**
+ * Computes 1 / u_i^(1/P) for the uniform variable u_i of key i, which is a division for
+ * p = 1 and a reciprocal square root for p = 2.
+ */
+template <uint16_t P>
+double LpSampler<P>::scalar(const uint64_t i, const uint64_t* powers) const {
+    if (i < key_scalars_.size()) {
+        return key_scalars_[i];
+    }
+    const uint64_t h = powers ? scalars_.hash_powers(powers) : scalars_.hash(i);
+    double u_i = h / static_cast<double>(scalars_.get_mp());  // Uni(0, 1)
+    if constexpr (P == 1) {
+        return 1 / u_i;
+    } else {
+        return 1 / std::sqrt(u_i);
+    }
+}
 
-    cs_->update(i, z_i);
-    fp_->update(i, delta);
-    f2_err_->update(i, z_i);
+/**
+ * Materializes the scaling factor of every key in [0, n), the buckets and signs of the
+ * CountSketch, and for p = 1 the Cauchy variables of an F1Estimator. The sketches are
+ * filled by one thread per hardware thread.
+ */
+template <uint16_t P>
+void LpSampler<P>::precompute() {
+    std::vector<double> key_scalars(n_);
+    for (uint64_t i = 0; i < n_; ++i) {
+        key_scalars[i] = scalar(i);
+    }
+    key_scalars_ = std::move(key_scalars);
+    cs_.precompute(n_);
+    if constexpr (P == 1) {
+        if (auto* f1 = std::get_if<F1Estimator>(&fp_)) {
+            f1->precompute(n_);
+        }
+    }
 }
 
-std::optional<uint64_t> LpSampler::sample() const {
-    if (sampled_) {
-        throw std::runtime_error("Already sampled");
+/**
+ * Applies the update (i, delta) to every sketch. The powers of a key below 2^61 are
+ * computed once, and every polynomial hash of the key is evaluated from them: its
+ * scaling factor, its buckets and signs in the CountSketch and the F2 sketches, and for
+ * KnwF1Estimator its buckets and signs. Each hash then costs a few independent
+ * multiplications instead of a dependent chain, and gives the same value as hashing the
+ * key. The Cauchy variables of F1Estimator hash a mix of the key and are unaffected.
+ */
+template <uint16_t P>
+void LpSampler<P>::update(const uint64_t i, const double delta) {
+    const uint64_t* powers = nullptr;
+    if (i < kPowersLimit) {
+        KWiseHash::powers(i, powers_.data(), powers_.size());
+        powers = powers_.data();
     }
-    sampled_ = true;
+    double z_i = delta * scalar(i, powers);
+
+    cs_.update(i, powers, z_i);
+    std::visit(
+        [&](auto& fp) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(fp)>, F1Estimator>) {
+                fp.update(i, delta);
+            } else {
+                fp.update(i, powers, delta);
+            }
+        },
+        fp_);
+    f2_err_.update(i, powers, z_i);
+}
 
-    double r = 1.5 * fp_->estimate_norm();
+/**
+ * Scans the CountSketch estimates z*_i of the scaled vector z for the largest one,
+ * keeping the m largest in a heap. The residual z - z_hat, for z_hat the vector of those
+ * m estimates, is estimated from f2_err_ by correcting the counters of their buckets
+ * rather than subtracting a sketch of z_hat, so no sketch is modified. The heap and the
+ * row estimates of each key live in buffers of the sampler, and the keys are hashed
+ * from their powers as in update(), so a scan allocates nothing.
+ *
+ * \return The key with the largest scaled estimate, or nothing if the residual is too
+ * large or that estimate too small for the sample to be accurate.
+ */
+template <uint16_t P>
+std::optional<uint64_t> LpSampler<P>::sample() {
+    double r = 1.5 * std::visit([](const auto& fp) { return fp.estimate_norm(); }, fp_);
 
+    // A min-heap on |z*_i|, so that its front is the smallest of the m largest.
     auto cmp = [](const std::pair<uint64_t, double>& a,
                   const std::pair<uint64_t, double>& b) {
-        return std::fabs(a.second) >= std::fabs(b.second);
+        return std::fabs(a.second) > std::fabs(b.second);
     };
-    std::priority_queue<std::pair<uint64_t, double>,
-                        std::vector<std::pair<uint64_t, double>>,
-                        decltype(cmp)>
-        pq;
+    top_.clear();
 
+    const uint64_t precomputed = cs_.residual().precomputed();
     std::pair<uint64_t, double> max_pair = {0, 0};
-    for (size_t i = 0; i < n_; ++i) {
-        double z_star_i = cs_->estimate(i);
+    for (uint64_t i = 0; i < n_; ++i) {
+        const uint64_t* powers = nullptr;
+        if (i >= precomputed && i < kPowersLimit) {
+            KWiseHash::powers(i, powers_.data(), CountSketch::kHashPowers);
+            powers = powers_.data();
+        }
+        double z_star_i = cs_.estimate(i, powers, row_estimates_.data());
 
         if (std::fabs(z_star_i) > std::fabs(max_pair.second)) {
             max_pair = {i, z_star_i};
         }
 
-        if (pq.size() < m_) {
-            pq.push({i, z_star_i});
-        } else if (std::fabs(pq.top().second) < std::fabs(z_star_i)) {
-            pq.pop();
-            pq.push({i, z_star_i});
+        if (top_.size() < m_) {
+            top_.emplace_back(i, z_star_i);
+            std::push_heap(top_.begin(), top_.end(), cmp);
+        } else if (std::fabs(top_.front().second) < std::fabs(z_star_i)) {
+            std::pop_heap(top_.begin(), top_.end(), cmp);
+            top_.back() = {i, z_star_i};
+            std::push_heap(top_.begin(), top_.end(), cmp);
         }
     }
 
-    F2Estimator m_sparse(norm_eps_, delta_ / 2, seed_);
-    while (!pq.empty()) {
-        auto pair = pq.top();
-        pq.pop();
-        m_sparse.update(pair.first, pair.second);
-    }
-
-    f2_err_->subtract(m_sparse);
-    double s = 1.5 * f2_err_->estimate_norm();
+    double s = 1.5 * f2_err_.estimate_residual_norm(top_, residual_buckets_);
 
-    if (s > std::pow(eps_, 1 - 1 / p_) * r * std::sqrt(m_) ||
-        std::fabs(max_pair.second) < r / std::pow(eps_, 1 / p_)) {
+    if (s > residual_factor_ * r || std::fabs(max_pair.second) < max_factor_ * r) {
         return std::nullopt;
     }
     return max_pair.first;
-}
\ No newline at end of file
+}
+
+template <uint16_t P>
+void LpSampler<P>::check_compatible(const LpSampler& other) const {
+    if (eps_ != other.eps_ || delta_ != other.delta_ || n_ != other.n_ ||
+        seed_ != other.seed_ || options_.heavy_keys != other.options_.heavy_keys ||
+        options_.sketch.w != other.options_.sketch.w ||
+        options_.sketch.d != other.options_.sketch.d ||
+        options_.sketch.counter != other.options_.sketch.counter ||
+        options_.norm_counter != other.options_.norm_counter ||
+        options_.precompute != other.options_.precompute ||
+        fp_.index() != other.fp_.index()) {
+        throw std::invalid_argument("Samplers have different parameters");
+    }
+}
+
+/**
+ * Adds the sketches of other to this sampler, so that it samples from the concatenation
+ * of both streams. Since the scaling factors are derived from the shared seed, each key
+ * is scaled the same way in both samplers, and every component is merged separately.
+ *
+ * \param other A sampler with the same parameters and options.
+ */
+template <uint16_t P>
+void LpSampler<P>::merge(const LpSampler& other) {
+    check_compatible(other);
+    cs_.merge(other.cs_);
+    std::visit(
+        [&](auto& fp) {
+            fp.merge(std::get<std::decay_t<decltype(fp)>>(other.fp_));
+        },
+        fp_);
+    f2_err_.merge(other.f2_err_);
+}
+
+/**
+ * Subtracts the sketches of other from this sampler, so that it samples from the
+ * difference of the two frequency vectors.
+ *
+ * \param other A sampler with the same parameters and options.
+ */
+template <uint16_t P>
+void LpSampler<P>::subtract(const LpSampler& other) {
+    check_compatible(other);
+    cs_.subtract(other.cs_);
+    std::visit(
+        [&](auto& fp) {
+            fp.subtract(std::get<std::decay_t<decltype(fp)>>(other.fp_));
+        },
+        fp_);
+    f2_err_.subtract(other.f2_err_);
+}
+
+template <uint16_t P>
+void LpSampler<P>::scale(double a) {
+    cs_.scale(a);
+    std::visit([&](auto& fp) { fp.scale(a); }, fp_);
+    f2_err_.scale(a);
+}
+
+/**
+ * Writes p u16, eps f64, delta f64, n u64, seed u64, the options as heavy_keys u64,
+ * sketch width u64, sketch depth u64, counter type u8, norm counter type u8, F1
+ * estimator type u8 and precompute u8, and a u8 that is always 0, followed by the
+ * CountSketch, the Fp estimator (F1Estimator or KnwF1Estimator for p = 1, F2Estimator
+ * for p = 2) and the residual F2Estimator.
+ */
+template <uint16_t P>
+void LpSampler<P>::save(std::ostream& os) const {
+    serialization::BinaryWriter out(os);
+    out.begin(serialization::SketchType::kLpSampler);
+    out.write_u16(P);
+    out.write_f64(eps_);
+    out.write_f64(delta_);
+    out.write_u64(n_);
+    out.write_u64(seed_);
+    out.write_u64(options_.heavy_keys);
+    out.write_u64(options_.sketch.w);
+    out.write_u64(options_.sketch.d);
+    out.write_u8(static_cast<uint8_t>(options_.sketch.counter));
+    out.write_u8(static_cast<uint8_t>(options_.norm_counter));
+    out.write_u8(static_cast<uint8_t>(options_.f1_estimator));
+    out.write_bool(options_.precompute);
+    // Formerly whether the sampler had been sampled, which modified its residual sketch.
+    out.write_bool(false);
+
+    cs_.write(out);
+    std::visit([&](const auto& fp) { fp.write(out); }, fp_);
+    f2_err_.write(out);
+    out.end();
+}
+
+template <uint16_t P>
+LpSampler<P> LpSampler<P>::load(std::istream& is) {
+    serialization::BinaryReader in(is);
+    in.begin(serialization::SketchType::kLpSampler);
+    uint16_t p = in.read_u16();
+    if (p != P) {
+        throw std::runtime_error("Serialized sampler is for p = " + std::to_string(p));
+    }
+    double eps = in.read_f64();
+    double delta = in.read_f64();
+    uint64_t n = in.read_u64();
+    uint64_t seed = in.read_u64();
+    LpSamplerOptions options;
+    options.heavy_keys = in.read_u64();
+    options.sketch.w = in.read_u64();
+    options.sketch.d = in.read_u64();
+    uint8_t counter = in.read_u8();
+    // Records before version 3 have no norm counter type and store doubles.
+    uint8_t norm_counter = in.get_version() < 3 ? 0 : in.read_u8();
+    if (counter > static_cast<uint8_t>(CounterType::kFloat) ||
+        norm_counter > static_cast<uint8_t>(CounterType::kFloat)) {
+        throw std::runtime_error("Unknown counter type in serialized sketch");
+    }
+    options.sketch.counter = static_cast<CounterType>(counter);
+    options.norm_counter = static_cast<CounterType>(norm_counter);
+    // Records before version 4 have no F1 estimator type and hold an F1Estimator.
+    uint8_t f1_estimator = in.get_version() < 4 ? 0 : in.read_u8();
+    if (f1_estimator > static_cast<uint8_t>(F1EstimatorType::kKnw)) {
+        throw std::runtime_error("Unknown F1 estimator type in serialized sampler");
+    }
+    options.f1_estimator = static_cast<F1EstimatorType>(f1_estimator);
+    // The sketches are saved without their materialized keys, which are recomputed
+    // once they are read. Records before version 4 have no precompute flag.
+    options.precompute = in.get_version() < 4 ? false : in.read_bool();
+    // Before sample() left the sketches intact, this byte marked samplers whose
+    // residual sketch it had modified, which cannot be sampled again.
+    if (in.read_bool()) {
+        throw std::runtime_error("Serialized sampler was saved after sampling");
+    }
+
+    LpSampler sampler(eps, delta, n, seed, options, in);
+    in.end();
+    if (options.precompute) {
+        sampler.precompute();
+    }
+    return sampler;
+}
+
+template class LpSampler<1>;
+template class LpSampler<2>;
@@ -0,0 +1,116 @@
+#include "MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "Serialization.h"
+
+namespace {
+
+constexpr char kMagic[4] = {'L', 'P', 'S', 'M'};
+
+std::runtime_error sys_error(const std::string& what, const std::string& path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+}  // namespace
+
+MappedFile::MappedFile(std::string path, unsigned char* data, size_t size)
+    : path_(std::move(path)), data_(data), size_(size) {}
+
+MappedFile::~MappedFile() {
+    munmap(data_, size_);
+}
+
+std::shared_ptr<MappedFile> MappedFile::create(const std::string& path, size_t size) {
+    if (size == 0) {
+        throw std::invalid_argument("Cannot map an empty file");
+    }
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw sys_error("Could not create", path);
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        auto err = sys_error("Could not resize", path);
+        ::close(fd);
+        throw err;
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw sys_error("Could not map", path);
+    }
+    return std::shared_ptr<MappedFile>(
+        new MappedFile(path, static_cast<unsigned char*>(data), size));
+}
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        throw sys_error("Could not open", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        auto err = sys_error("Could not stat", path);
+        ::close(fd);
+        throw err;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot map empty file " + path);
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw sys_error("Could not map", path);
+    }
+    return std::shared_ptr<MappedFile>(
+        new MappedFile(path, static_cast<unsigned char*>(data), size));
+}
+
+void MappedFile::sync() const {
+    if (msync(data_, size_, MS_SYNC) != 0) {
+        throw sys_error("Could not sync", path_);
+    }
+}
+
+std::shared_ptr<MappedFile> MappedFile::create_sketch(const std::string& path,
+                                                      serialization::SketchType type,
+                                                      size_t counter_bytes) {
+    if constexpr (std::endian::native != std::endian::little) {
+        throw std::runtime_error("Mapped sketches require a little-endian host");
+    }
+    auto file = create(path, kHeaderSize + counter_bytes);
+    std::memcpy(file->data_, kMagic, sizeof(kMagic));
+    file->put<uint16_t>(4, kLayoutVersion);
+    file->put<uint16_t>(6, static_cast<uint16_t>(type));
+    return file;
+}
+
+std::shared_ptr<MappedFile> MappedFile::open_sketch(const std::string& path,
+                                                    serialization::SketchType type) {
+    if constexpr (std::endian::native != std::endian::little) {
+        throw std::runtime_error("Mapped sketches require a little-endian host");
+    }
+    auto file = open(path);
+    if (file->size_ < kHeaderSize ||
+        std::memcmp(file->data_, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error(path + " is not a mapped sketch");
+    }
+    if (file->get<uint16_t>(4) != kLayoutVersion) {
+        throw std::runtime_error(path + " has an unsupported layout version");
+    }
+    if (file->get<uint16_t>(6) != static_cast<uint16_t>(type)) {
+        throw std::runtime_error(path + " holds a different type of sketch");
+    }
+    return file;
+}
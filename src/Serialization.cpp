@@ -0,0 +1,234 @@
+#include "Serialization.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace serialization {
+
+namespace {
+
+constexpr char kMagic[4] = {'L', 'P', 'S', 'K'};
+constexpr uint64_t kChecksumSeed = 0xcbf29ce484222325ULL;  // FNV-1a offset basis
+constexpr uint64_t kChecksumPrime = 0x100000001b3ULL;      // FNV-1a prime
+constexpr size_t kSwapChunk = 1024;  // elements converted at a time on big-endian hosts
+
+constexpr bool kLittleEndian = std::endian::native == std::endian::little;
+
+uint64_t to_le(uint64_t val) {
+    return kLittleEndian ? val : __builtin_bswap64(val);
+}
+
+uint32_t to_le(uint32_t val) {
+    return kLittleEndian ? val : __builtin_bswap32(val);
+}
+
+uint16_t to_le(uint16_t val) {
+    return kLittleEndian ? val : __builtin_bswap16(val);
+}
+
+/**
+ * An FNV-1a style checksum that consumes whole 8-byte little-endian words where it can,
+ * so that large counter tables are checksummed at memory speed. Writer and reader issue
+ * the same sequence of calls, so both see the same word boundaries.
+ */
+uint64_t update_checksum(uint64_t h, const void* data, size_t n) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        h = (h ^ to_le(word)) * kChecksumPrime;
+        h ^= h >> 29;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ bytes[i]) * kChecksumPrime;
+    }
+    return h;
+}
+
+}  // namespace
+
+uint64_t checked_mul(uint64_t a, uint64_t b) {
+    if (a != 0 && b > std::numeric_limits<uint64_t>::max() / a) {
+        throw std::runtime_error("Serialized sketch has an impossible size");
+    }
+    return a * b;
+}
+
+BinaryWriter::BinaryWriter(std::ostream& os) : os_(os) {}
+
+void BinaryWriter::write_bytes(const void* data, size_t n) {
+    checksum_ = update_checksum(checksum_, data, n);
+    os_.write(static_cast<const char*>(data), static_cast<std::streamsize>(n));
+    if (!os_) {
+        throw std::runtime_error("Failed to write sketch");
+    }
+}
+
+void BinaryWriter::begin(SketchType type) {
+    checksum_ = kChecksumSeed;
+    write_bytes(kMagic, sizeof(kMagic));
+    write_u16(kFormatVersion);
+    write_u16(static_cast<uint16_t>(type));
+}
+
+void BinaryWriter::end() {
+    uint64_t checksum = to_le(checksum_);
+    os_.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    if (!os_) {
+        throw std::runtime_error("Failed to write sketch");
+    }
+}
+
+void BinaryWriter::write_u8(uint8_t val) {
+    write_bytes(&val, sizeof(val));
+}
+
+void BinaryWriter::write_u16(uint16_t val) {
+    val = to_le(val);
+    write_bytes(&val, sizeof(val));
+}
+
+void BinaryWriter::write_u64(uint64_t val) {
+    val = to_le(val);
+    write_bytes(&val, sizeof(val));
+}
+
+void BinaryWriter::write_f64(double val) {
+    write_u64(std::bit_cast<uint64_t>(val));
+}
+
+void BinaryWriter::write_f64s(const double* data, size_t n) {
+    if (kLittleEndian) {
+        write_bytes(data, n * sizeof(double));
+        return;
+    }
+    std::vector<uint64_t> buf(std::min(n, kSwapChunk));
+    for (size_t i = 0; i < n; i += kSwapChunk) {
+        size_t len = std::min(n - i, kSwapChunk);
+        for (size_t j = 0; j < len; ++j) {
+            buf[j] = to_le(std::bit_cast<uint64_t>(data[i + j]));
+        }
+        write_bytes(buf.data(), len * sizeof(uint64_t));
+    }
+}
+
+void BinaryWriter::write_f32s(const float* data, size_t n) {
+    if (kLittleEndian) {
+        write_bytes(data, n * sizeof(float));
+        return;
+    }
+    std::vector<uint32_t> buf(std::min(n, kSwapChunk));
+    for (size_t i = 0; i < n; i += kSwapChunk) {
+        size_t len = std::min(n - i, kSwapChunk);
+        for (size_t j = 0; j < len; ++j) {
+            buf[j] = to_le(std::bit_cast<uint32_t>(data[i + j]));
+        }
+        write_bytes(buf.data(), len * sizeof(uint32_t));
+    }
+}
+
+BinaryReader::BinaryReader(std::istream& is) : is_(is) {}
+
+void BinaryReader::read_bytes(void* data, size_t n) {
+    is_.read(static_cast<char*>(data), static_cast<std::streamsize>(n));
+    if (!is_) {
+        throw std::runtime_error("Unexpected end of sketch data");
+    }
+    checksum_ = update_checksum(checksum_, data, n);
+}
+
+void BinaryReader::begin(SketchType type) {
+    checksum_ = kChecksumSeed;
+    char magic[sizeof(kMagic)];
+    read_bytes(magic, sizeof(magic));
+    if (std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error("Not a serialized sketch");
+    }
+    version_ = read_u16();
+    if (version_ < kMinFormatVersion || version_ > kFormatVersion) {
+        throw std::runtime_error("Unsupported sketch format version " +
+                                 std::to_string(version_));
+    }
+    if (read_u16() != static_cast<uint16_t>(type)) {
+        throw std::runtime_error("Serialized sketch has a different type");
+    }
+}
+
+void BinaryReader::end() {
+    uint64_t expected = checksum_;
+    uint64_t checksum;
+    is_.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+    if (!is_) {
+        throw std::runtime_error("Unexpected end of sketch data");
+    }
+    if (to_le(checksum) != expected) {
+        throw std::runtime_error("Sketch checksum mismatch");
+    }
+}
+
+uint8_t BinaryReader::read_u8() {
+    uint8_t val;
+    read_bytes(&val, sizeof(val));
+    return val;
+}
+
+uint16_t BinaryReader::read_u16() {
+    uint16_t val;
+    read_bytes(&val, sizeof(val));
+    return to_le(val);
+}
+
+uint64_t BinaryReader::read_u64() {
+    uint64_t val;
+    read_bytes(&val, sizeof(val));
+    return to_le(val);
+}
+
+double BinaryReader::read_f64() {
+    return std::bit_cast<double>(read_u64());
+}
+
+void BinaryReader::check_length(uint64_t n, size_t size) {
+    uint64_t bytes = checked_mul(n, size);
+    std::streampos pos = is_.tellg();
+    if (pos == std::streampos(-1)) {
+        return;
+    }
+    is_.seekg(0, std::ios::end);
+    std::streampos end = is_.tellg();
+    is_.clear();
+    is_.seekg(pos);
+    if (!is_) {
+        throw std::runtime_error("Failed to read sketch");
+    }
+    if (end != std::streampos(-1) && static_cast<uint64_t>(end - pos) < bytes) {
+        throw std::runtime_error("Serialized sketch is larger than its data");
+    }
+}
+
+void BinaryReader::read_f64s(double* data, size_t n) {
+    read_bytes(data, n * sizeof(double));
+    if (!kLittleEndian) {
+        for (size_t i = 0; i < n; ++i) {
+            data[i] = std::bit_cast<double>(to_le(std::bit_cast<uint64_t>(data[i])));
+        }
+    }
+}
+
+void BinaryReader::read_f32s(float* data, size_t n) {
+    read_bytes(data, n * sizeof(float));
+    if (!kLittleEndian) {
+        for (size_t i = 0; i < n; ++i) {
+            data[i] = std::bit_cast<float>(to_le(std::bit_cast<uint32_t>(data[i])));
+        }
+    }
+}
+
+}  // namespace serialization
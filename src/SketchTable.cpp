@@ -0,0 +1,367 @@
+#include "SketchTable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "KWiseHash.h"
+#include "MappedFile.h"
+#include "MurmurHash3.h"
+#include "Serialization.h"
+#include "SimdKernels.h"
+
+SketchTable::SketchTable(
+    size_t w, size_t d, uint64_t seed, bool murmur, bool sparse, CounterType counter)
+    : w_(w),
+      d_(d),
+      seed_(seed),
+      use_murmur_(murmur),
+      counter_(counter),
+      dense_(!sparse),
+      table_(sparse || counter != CounterType::kDouble ? 0 : d * w, 0),
+      table32_(sparse || counter != CounterType::kFloat ? 0 : d * w, 0) {
+    if (!use_murmur_) {
+        for (size_t i = 0; i < d_; ++i) {
+            index_hashes_.emplace_back(KWiseHash(2, seed_ + i));
+        }
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const SketchTable& table) {
+    if (table.w_ <= 25) {
+        for (size_t i = 0; i < table.d_; ++i) {
+            for (size_t j = 0; j < table.w_; ++j) {
+                os << table.get(i, j) << " ";
+            }
+            os << std::endl;
+        }
+    }
+    return os;
+}
+
+/**
+ * A hash function that returns the bucket that a key is hashed into for the
+ * i-th row. If use_murmur_ is true, uses MurmurHash3. Otherwise, uses a simple
+ * multiply-shift hash function. MurmurHash3 is not 2-wise independent, but may
+ * be faster in practice. Multiply-shift is 2-wise independent, but may be
+ * slower in practice.
+ *
+ * \param i The index of the row
+ * \param key The key to hash.
+ * \param powers The powers of the key up to x^1, or null to hash the key itself.
+ * \return The index of the column in the row that the key is hashed to.
+ */
+size_t SketchTable::idx_hash(const size_t i,
+                             const uint64_t key,
+                             const uint64_t* powers) const {
+    if (i >= d_) {
+        throw std::out_of_range("i is out of range");
+    }
+
+    uint64_t res = 0;
+    if (use_murmur_) {
+        res = murmur_hash3_64(key, seed_ + i);
+    } else {
+        res = powers ? index_hashes_[i].hash_powers(powers) : index_hashes_[i].hash(key);
+    }
+    return res % w_;
+}
+
+/**
+ * Returns the counter in the idx-th bucket of the i-th row, regardless of whether the
+ * table is currently sparse or dense.
+ */
+double SketchTable::get(const size_t i, const size_t idx) const {
+    if (dense_) {
+        return counter_ == CounterType::kDouble ? table_[i * w_ + idx]
+                                                : table32_[i * w_ + idx];
+    }
+    auto it = sparse_.find(i * w_ + idx);
+    return it == sparse_.end() ? 0 : it->second;
+}
+
+/**
+ * Adds val to the counter in the idx-th bucket of the i-th row. While sparse, converts
+ * to the dense table once the map holds more than d_ * w_ / kSparseFactor counters.
+ */
+void SketchTable::add(const size_t i, const size_t idx, const double val) {
+    if (dense_) {
+        if (counter_ == CounterType::kDouble) {
+            table_[i * w_ + idx] += val;
+        } else {
+            table32_[i * w_ + idx] += static_cast<float>(val);
+        }
+        return;
+    }
+    sparse_[i * w_ + idx] += val;
+    if (sparse_.size() * kSparseFactor > d_ * w_) {
+        densify();
+    }
+}
+
+// Moves the counters from the sparse map into the dense d_ x w_ table.
+void SketchTable::densify() {
+    if (dense_) {
+        return;
+    }
+    if (counter_ == CounterType::kDouble) {
+        table_.assign(d_ * w_, 0);
+        for (const auto& [pos, val] : sparse_) {
+            table_[pos] = val;
+        }
+    } else {
+        table32_.assign(d_ * w_, 0);
+        for (const auto& [pos, val] : sparse_) {
+            table32_[pos] = static_cast<float>(val);
+        }
+    }
+    sparse_.clear();
+    sparse_.rehash(0);
+    dense_ = true;
+}
+
+bool SketchTable::compatible(const SketchTable& other) const {
+    return w_ == other.w_ && d_ == other.d_ && seed_ == other.seed_ &&
+           use_murmur_ == other.use_murmur_ && counter_ == other.counter_;
+}
+
+/**
+ * Computes the dot product of each row of this table with the same row of other. Dense
+ * rows are reduced with the vectorized kernels of SimdKernels.h. If either table is
+ * still sparse, only its touched counters can contribute, so those are looked up in the
+ * other table instead.
+ *
+ * \param other A table with the same width, depth, seed, hash family and counter type.
+ * \return The d row dot products.
+ */
+std::vector<double> SketchTable::row_dots(const SketchTable& other) const {
+    if (!compatible(other)) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+
+    std::vector<double> dots(d_, 0);
+    if (!dense_ || !other.dense_) {
+        const SketchTable& sparse = !dense_ ? *this : other;
+        const SketchTable& rest = !dense_ ? other : *this;
+        for (const auto& [pos, val] : sparse.sparse_) {
+            dots[pos / w_] += val * rest.get(pos / w_, pos % w_);
+        }
+        return dots;
+    }
+
+    for (size_t i = 0; i < d_; ++i) {
+        if (counter_ == CounterType::kDouble) {
+            dots[i] = simd::dot(table_.data() + i * w_, other.table_.data() + i * w_, w_);
+        } else {
+            dots[i] =
+                simd::dot(table32_.data() + i * w_, other.table32_.data() + i * w_, w_);
+        }
+    }
+    return dots;
+}
+
+/**
+ * Adds the counters of other to this table, so that it summarizes the concatenation of
+ * both streams. Both tables must share the width, depth, seed, hash family and counter
+ * type.
+ *
+ * \param other The table to merge into this one.
+ */
+void SketchTable::merge(const SketchTable& other) {
+    add_scaled(other, 1);
+}
+
+/**
+ * Subtracts the counters of other from this table, so that it summarizes the
+ * difference of the two frequency vectors. Both tables must share the width, depth,
+ * seed, hash family and counter type.
+ *
+ * \param other The table to subtract from this one.
+ */
+void SketchTable::subtract(const SketchTable& other) {
+    add_scaled(other, -1);
+}
+
+void SketchTable::add_scaled(const SketchTable& other, double a) {
+    if (!compatible(other)) {
+        throw std::invalid_argument("Sketches have different parameters");
+    }
+    if (this == &other) {
+        add_scaled(SketchTable(other), a);
+        return;
+    }
+
+    if (!other.dense_) {
+        for (const auto& [pos, val] : other.sparse_) {
+            add(pos / w_, pos % w_, a * val);
+        }
+        return;
+    }
+
+    densify();
+    simd::axpy(a, other.table_.data(), table_.data(), table_.size());
+    simd::axpy(a, other.table32_.data(), table32_.data(), table32_.size());
+}
+
+/**
+ * Multiplies every counter by a, so that the table summarizes the stream with every
+ * update scaled by a.
+ *
+ * \param a The factor to scale by.
+ */
+void SketchTable::scale(double a) {
+    for (auto& [pos, val] : sparse_) {
+        val *= a;
+    }
+    simd::scale(a, table_.data(), table_.size());
+    simd::scale(a, table32_.data(), table32_.size());
+}
+
+/**
+ * Creates a dense table whose counters live in a new file at path. Besides the common
+ * header of MappedFile.h, the file records w u64 at byte 8, d u64 at byte 16, seed u64
+ * at byte 24, murmur u8 at byte 32 and counter u8 at byte 33.
+ */
+SketchTable SketchTable::create_mapped(const std::string& path,
+                                       serialization::SketchType type,
+                                       size_t w,
+                                       size_t d,
+                                       uint64_t seed,
+                                       bool murmur,
+                                       CounterType counter) {
+    size_t bytes = counter == CounterType::kDouble ? sizeof(double) : sizeof(float);
+    auto file = MappedFile::create_sketch(
+        path, type, serialization::checked_mul(serialization::checked_mul(w, d), bytes));
+    file->put<uint64_t>(8, w);
+    file->put<uint64_t>(16, d);
+    file->put<uint64_t>(24, seed);
+    file->put<uint8_t>(32, murmur);
+    file->put<uint8_t>(33, static_cast<uint8_t>(counter));
+
+    // Constructed sparse so that no owned counters are allocated, then pointed at the
+    // file.
+    SketchTable table(w, d, seed, murmur, true, counter);
+    if (counter == CounterType::kDouble) {
+        table.table_ = CounterBuffer<double>(file, MappedFile::kHeaderSize, w * d);
+    } else {
+        table.table32_ = CounterBuffer<float>(file, MappedFile::kHeaderSize, w * d);
+    }
+    table.dense_ = true;
+    return table;
+}
+
+SketchTable SketchTable::open_mapped(const std::string& path,
+                                     serialization::SketchType type) {
+    auto file = MappedFile::open_sketch(path, type);
+    size_t w = file->get<uint64_t>(8);
+    size_t d = file->get<uint64_t>(16);
+    uint64_t seed = file->get<uint64_t>(24);
+    bool murmur = file->get<uint8_t>(32) != 0;
+    uint8_t counter = file->get<uint8_t>(33);
+    if (counter > static_cast<uint8_t>(CounterType::kFloat)) {
+        throw std::runtime_error(path + " has an unknown counter type");
+    }
+    size_t bytes = counter == 0 ? sizeof(double) : sizeof(float);
+    if (file->size() - MappedFile::kHeaderSize !=
+        serialization::checked_mul(serialization::checked_mul(w, d), bytes)) {
+        throw std::runtime_error(path + " does not match the size of its table");
+    }
+
+    SketchTable table(w, d, seed, murmur, true, static_cast<CounterType>(counter));
+    if (table.counter_ == CounterType::kDouble) {
+        table.table_ = CounterBuffer<double>(file, MappedFile::kHeaderSize, w * d);
+    } else {
+        table.table32_ = CounterBuffer<float>(file, MappedFile::kHeaderSize, w * d);
+    }
+    table.dense_ = true;
+    return table;
+}
+
+void SketchTable::sync() const {
+    if (table_.file()) {
+        table_.file()->sync();
+    }
+    if (table32_.file()) {
+        table32_.file()->sync();
+    }
+}
+
+/**
+ * Writes the table as
+ *
+ *   w u64, d u64, seed u64, murmur u8, counter u8, dense u8,
+ *   dense:  d * w counters, f64 or f32 by counter type, row-major
+ *   sparse: count u64, then count pairs of (row * w + bucket) u64 and counter f64,
+ *           in increasing position
+ */
+void SketchTable::write(serialization::BinaryWriter& out) const {
+    out.write_u64(w_);
+    out.write_u64(d_);
+    out.write_u64(seed_);
+    out.write_bool(use_murmur_);
+    out.write_u8(static_cast<uint8_t>(counter_));
+    out.write_bool(dense_);
+
+    if (dense_) {
+        if (counter_ == CounterType::kDouble) {
+            out.write_f64s(table_.data(), table_.size());
+        } else {
+            out.write_f32s(table32_.data(), table32_.size());
+        }
+        return;
+    }
+
+    std::vector<std::pair<uint64_t, double>> entries(sparse_.begin(), sparse_.end());
+    std::sort(entries.begin(), entries.end());
+    out.write_u64(entries.size());
+    for (const auto& [pos, val] : entries) {
+        out.write_u64(pos);
+        out.write_f64(val);
+    }
+}
+
+SketchTable SketchTable::read(serialization::BinaryReader& in) {
+    size_t w = in.read_u64();
+    size_t d = in.read_u64();
+    uint64_t seed = in.read_u64();
+    bool murmur = in.read_bool();
+    uint8_t counter = in.read_u8();
+    bool dense = in.read_bool();
+    if (counter > static_cast<uint8_t>(CounterType::kFloat)) {
+        throw std::runtime_error("Unknown counter type in serialized sketch");
+    }
+    // A sparse table may become dense later, so its shape must be addressable too.
+    const size_t bytes = counter == static_cast<uint8_t>(CounterType::kFloat)
+                             ? sizeof(float)
+                             : sizeof(double);
+    uint64_t cells = serialization::checked_mul(w, d);
+    serialization::checked_mul(cells, bytes);
+    if (dense) {
+        in.check_length(cells, bytes);
+    }
+
+    SketchTable table(w, d, seed, murmur, !dense, static_cast<CounterType>(counter));
+    if (dense) {
+        if (table.counter_ == CounterType::kDouble) {
+            in.read_f64s(table.table_.data(), table.table_.size());
+        } else {
+            in.read_f32s(table.table32_.data(), table.table32_.size());
+        }
+        return table;
+    }
+
+    size_t count = in.read_u64();
+    in.check_length(count, 2 * sizeof(uint64_t));
+    table.sparse_.reserve(count);
+    for (size_t j = 0; j < count; ++j) {
+        uint64_t pos = in.read_u64();
+        if (pos >= cells) {
+            throw std::runtime_error(
+                "Counter position out of range in serialized sketch");
+        }
+        table.sparse_[pos] = in.read_f64();
+    }
+    return table;
+}